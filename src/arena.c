@@ -0,0 +1,60 @@
+#include "arena.h"
+
+static ArenaBlock *create_arena_block(Arena *arena, u64 min_size) {
+    u64 size = arena->block_size > min_size ? arena->block_size : min_size;
+    ArenaBlock *block = tracked_malloc(arena->tag, sizeof(ArenaBlock) + size);
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    arena->heap_allocations++;
+    return block;
+}
+
+void init_arena(Arena *arena, u64 block_size, MemoryTag tag) {
+    arena->block_size = block_size;
+    arena->tag = tag;
+    arena->heap_allocations = 0;
+    arena->first = create_arena_block(arena, block_size);
+    arena->current = arena->first;
+}
+
+void destroy_arena(Arena *arena) {
+    ArenaBlock *block = arena->first;
+    while(block) {
+        ArenaBlock *next = block->next;
+        tracked_free(block);
+        block = next;
+    }
+    arena->first = NULL;
+    arena->current = NULL;
+}
+
+void *arena_alloc_aligned(Arena *arena, u64 size, u64 alignment) {
+    ArenaBlock *block = arena->current;
+
+    while(1) {
+        uintptr_t base = (uintptr_t) block->data;
+        u64 offset = ALIGN_UP(base + block->used, alignment) - base;
+        if(offset + size <= block->size) {
+            block->used = offset + size;
+            arena->current = block;
+            return block->data + offset;
+        }
+
+        // Reuse blocks from earlier frames before growing
+        if(!block->next) {
+            block->next = create_arena_block(arena, size + alignment);
+        }
+        block = block->next;
+        block->used = 0;
+    }
+}
+
+void *arena_alloc(Arena *arena, u64 size) {
+    return arena_alloc_aligned(arena, size, ARENA_ALIGNMENT);
+}
+
+void arena_reset(Arena *arena) {
+    arena->first->used = 0;
+    arena->current = arena->first;
+}
@@ -0,0 +1,36 @@
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include "util.h"
+#include "memory.h"
+
+#define ARENA_ALIGNMENT 16
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    u64 size;
+    u64 used;
+    _Alignas(ARENA_ALIGNMENT) u8 data[];
+} ArenaBlock;
+
+// Linear allocator, memory is only given back all at once with arena_reset()
+// Blocks are kept across resets so once the arena has grown to fit a frame it no longer touches the heap
+typedef struct {
+    ArenaBlock *first;
+    ArenaBlock *current;
+    u64 block_size;
+    MemoryTag tag;
+
+    // Number of blocks allocated from the heap so far
+    u64 heap_allocations;
+} Arena;
+
+void init_arena(Arena *arena, u64 block_size, MemoryTag tag);
+void destroy_arena(Arena *arena);
+
+// Alignment must be a power of two
+void *arena_alloc_aligned(Arena *arena, u64 size, u64 alignment);
+void *arena_alloc(Arena *arena, u64 size);
+void arena_reset(Arena *arena);
+
+#endif
@@ -19,6 +19,8 @@ typedef struct {
 
     f32 pitch;
     f32 yaw;
+
+    f32 far_plane;
 } Camera;
 
 void update_camera(Camera *camera, Window *window);
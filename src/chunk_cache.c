@@ -0,0 +1,118 @@
+#include "chunk_cache.h"
+#include "chunk_io.h"
+#include "memory.h"
+
+#include <stdio.h>
+#include <string.h>
+
+void init_chunk_cache(ChunkCache *cache, u64 budget, struct ChunkIO *io) {
+    *cache = (ChunkCache) {0};
+    init_chunk_map(&cache->map, 1024);
+    cache->budget = budget;
+    cache->io = io;
+}
+
+void destroy_chunk_cache(ChunkCache *cache) {
+    CachedChunk *chunk = cache->newest;
+    while(chunk) {
+        CachedChunk *older = chunk->older;
+        tracked_free(chunk);
+        chunk = older;
+    }
+
+    destroy_chunk_map(&cache->map);
+}
+
+static void unlink_cached(ChunkCache *cache, CachedChunk *chunk) {
+    if(chunk->newer) {
+        chunk->newer->older = chunk->older;
+    } else {
+        cache->newest = chunk->older;
+    }
+
+    if(chunk->older) {
+        chunk->older->newer = chunk->newer;
+    } else {
+        cache->oldest = chunk->newer;
+    }
+
+    chunk_map_remove(&cache->map, chunk->pos);
+    cache->bytes -= sizeof(CachedChunk) + chunk->size;
+    cache->count--;
+}
+
+// Takes ownership of a chunk that left the cache
+static void save_and_free(ChunkCache *cache, CachedChunk *chunk) {
+    if(cache->io && !chunk->saved) {
+        chunk_io_save(cache->io, chunk);
+    } else {
+        tracked_free(chunk);
+    }
+}
+
+static void evict_to_budget(ChunkCache *cache) {
+    while(cache->bytes > cache->budget && cache->oldest) {
+        CachedChunk *chunk = cache->oldest;
+        unlink_cached(cache, chunk);
+        save_and_free(cache, chunk);
+        cache->evictions++;
+    }
+}
+
+void chunk_cache_put(ChunkCache *cache, ivec2s pos, const u8 *data, u32 size, bool saved) {
+    CachedChunk *existing = chunk_map_get(&cache->map, pos);
+    if(existing) {
+        unlink_cached(cache, existing);
+        tracked_free(existing);
+    }
+
+    CachedChunk *chunk = tracked_malloc(MEMORY_TAG_WORLD, sizeof(CachedChunk) + size);
+    chunk->pos = pos;
+    chunk->size = size;
+    chunk->saved = saved;
+    memcpy(chunk->data, data, size);
+
+    chunk->newer = NULL;
+    chunk->older = cache->newest;
+    if(cache->newest) {
+        cache->newest->newer = chunk;
+    } else {
+        cache->oldest = chunk;
+    }
+    cache->newest = chunk;
+
+    chunk_map_put(&cache->map, pos, chunk);
+    cache->bytes += sizeof(CachedChunk) + size;
+    cache->count++;
+
+    evict_to_budget(cache);
+}
+
+CachedChunk *chunk_cache_take(ChunkCache *cache, ivec2s pos) {
+    CachedChunk *chunk = chunk_map_get(&cache->map, pos);
+    if(!chunk) {
+        return NULL;
+    }
+
+    unlink_cached(cache, chunk);
+    chunk->newer = NULL;
+    chunk->older = NULL;
+    return chunk;
+}
+
+void flush_chunk_cache(ChunkCache *cache) {
+    while(cache->oldest) {
+        CachedChunk *chunk = cache->oldest;
+        unlink_cached(cache, chunk);
+        save_and_free(cache, chunk);
+    }
+}
+
+void print_chunk_cache_stats(const ChunkCache *cache) {
+    printf(
+        "Chunk cache: %u chunks, %.2f MB of %.2f MB, %lu evicted\n",
+        cache->count,
+        cache->bytes / (1024.0 * 1024.0),
+        cache->budget / (1024.0 * 1024.0),
+        cache->evictions);
+}
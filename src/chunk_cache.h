@@ -0,0 +1,53 @@
+#ifndef _CHUNK_CACHE_H
+#define _CHUNK_CACHE_H
+
+#include "util.h"
+#include "chunk_map.h"
+
+struct ChunkIO;
+
+typedef struct CachedChunk {
+    // Least recently used order, newer is closer to the head
+    struct CachedChunk *newer;
+    struct CachedChunk *older;
+
+    ivec2s pos;
+    u32 size;
+    // The region file holds the same data, so eviction does not need to write it
+    bool saved;
+    // Compressed chunk, see serialize_sections()
+    u8 data[];
+} CachedChunk;
+
+// Compressed unloaded chunks, the least recently stored ones are evicted once the budget is exceeded
+typedef struct {
+    ChunkMap map;
+    CachedChunk *newest;
+    CachedChunk *oldest;
+    u32 count;
+
+    // Bytes held by cached chunks, including their headers
+    u64 bytes;
+    u64 budget;
+
+    // Evicted chunks are saved through this if set, otherwise they are dropped and regenerated on return
+    struct ChunkIO *io;
+
+    u64 evictions;
+} ChunkCache;
+
+void init_chunk_cache(ChunkCache *cache, u64 budget, struct ChunkIO *io);
+void destroy_chunk_cache(ChunkCache *cache);
+
+// Copies the data, replaces an older copy of the same chunk
+void chunk_cache_put(ChunkCache *cache, ivec2s pos, const u8 *data, u32 size, bool saved);
+// Removes the chunk from the cache and hands it to the caller
+// The caller frees it with tracked_free(), NULL if the chunk is not cached
+CachedChunk *chunk_cache_take(ChunkCache *cache, ivec2s pos);
+
+// Empties the cache, chunks that are not in the region files yet are saved
+void flush_chunk_cache(ChunkCache *cache);
+
+void print_chunk_cache_stats(const ChunkCache *cache);
+
+#endif
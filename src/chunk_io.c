@@ -0,0 +1,313 @@
+// sem_timedwait() and clock_gettime() are newer than the POSIX version the build asks for
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include "chunk_io.h"
+#include "memory.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Pending saves are written once there are this many or no request came in for SAVE_DELAY_MS
+#define SAVE_BATCH_SIZE 64
+#define SAVE_DELAY_MS 250
+
+static bool queue_push(ChunkIOQueue *queue, ChunkIOMessage message) {
+    u32 tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    u32 head = atomic_load_explicit(&queue->head, memory_order_acquire);
+    if(tail - head == CHUNK_IO_QUEUE_SIZE) {
+        return false;
+    }
+
+    queue->messages[tail & (CHUNK_IO_QUEUE_SIZE - 1)] = message;
+    // Publishes the message
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+static bool queue_pop(ChunkIOQueue *queue, ChunkIOMessage *message) {
+    u32 head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    u32 tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+    if(head == tail) {
+        return false;
+    }
+
+    *message = queue->messages[head & (CHUNK_IO_QUEUE_SIZE - 1)];
+    // Hands the slot back to the producer
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return true;
+}
+
+// Moves backlogged requests to the ring in order, false if some are still left
+static bool flush_backlog(ChunkIO *io) {
+    u32 sent = 0;
+    while(sent < io->backlog_count && queue_push(&io->requests, io->backlog[sent])) {
+        sent++;
+    }
+
+    if(sent > 0) {
+        io->backlog_count -= sent;
+        memmove(io->backlog, io->backlog + sent, io->backlog_count * sizeof(ChunkIOMessage));
+        sem_post(&io->wake);
+    }
+    return io->backlog_count == 0;
+}
+
+static void send_request(ChunkIO *io, ChunkIOMessage request) {
+    // Nothing may overtake the backlog, a load could miss the save of the same chunk
+    if(flush_backlog(io) && queue_push(&io->requests, request)) {
+        sem_post(&io->wake);
+        return;
+    }
+
+    // The ring is full, chunk_io_poll() retries on a later frame instead of waiting for the I/O thread
+    if(io->backlog_count >= io->backlog_allocated) {
+        io->backlog_allocated = io->backlog_allocated ? io->backlog_allocated * 2 : CHUNK_IO_QUEUE_SIZE;
+        io->backlog = tracked_realloc(MEMORY_TAG_WORLD, io->backlog, io->backlog_allocated * sizeof(ChunkIOMessage));
+    }
+    io->backlog[io->backlog_count++] = request;
+}
+
+static void answer_load(ChunkIO *io, ivec2s pos) {
+    ChunkIOMessage completion = {.type = CHUNK_IO_LOAD, .pos = pos, .saved = true};
+
+    // A save that was not written yet is newer than the region file
+    CachedChunk *pending = chunk_map_remove(&io->pending_saves, pos);
+    if(pending) {
+        completion.chunk = pending;
+        completion.data = pending->data;
+        completion.size = pending->size;
+        completion.saved = pending->saved;
+    } else {
+        bool mapped;
+        completion.data = region_chunk_data(&io->store, pos, &completion.size, &mapped);
+        if(completion.data && !mapped) {
+            // Read into a buffer the next load reuses
+            CachedChunk *copy = tracked_malloc(MEMORY_TAG_WORLD, sizeof(CachedChunk) + completion.size);
+            *copy = (CachedChunk) {.pos = pos, .size = completion.size, .saved = true};
+            memcpy(copy->data, completion.data, completion.size);
+            completion.chunk = copy;
+            completion.data = copy->data;
+        }
+    }
+
+    // Never full, the main thread limits the loads in flight
+    queue_push(&io->completions, completion);
+    atomic_fetch_add(&io->loads, 1);
+
+    // Mappings replaced from now on stay until this completion was released
+    io->store.epoch = ++io->completions_sent;
+}
+
+static void queue_save(ChunkIO *io, CachedChunk *chunk) {
+    CachedChunk *older = chunk_map_remove(&io->pending_saves, chunk->pos);
+    if(older) {
+        tracked_free(older);
+    }
+    chunk_map_put(&io->pending_saves, chunk->pos, chunk);
+}
+
+// Orders by region, then by position in the region so each file is visited once
+static i32 compare_by_region(ivec2s a, ivec2s b) {
+    ivec2s region_a = region_of_chunk(a);
+    ivec2s region_b = region_of_chunk(b);
+    if(region_a.y != region_b.y) {
+        return region_a.y < region_b.y ? -1 : 1;
+    }
+    if(region_a.x != region_b.x) {
+        return region_a.x < region_b.x ? -1 : 1;
+    }
+    if(a.y != b.y) {
+        return a.y < b.y ? -1 : 1;
+    }
+    return a.x < b.x ? -1 : (a.x > b.x);
+}
+
+static int compare_messages(const void *a, const void *b) {
+    return compare_by_region(((const ChunkIOMessage *) a)->pos, ((const ChunkIOMessage *) b)->pos);
+}
+
+static int compare_chunks(const void *a, const void *b) {
+    return compare_by_region((*(CachedChunk * const *) a)->pos, (*(CachedChunk * const *) b)->pos);
+}
+
+static void write_pending_saves(ChunkIO *io) {
+    u32 count = io->pending_saves.count;
+    if(count == 0) {
+        return;
+    }
+
+    CachedChunk **chunks = tracked_malloc(MEMORY_TAG_WORLD, count * sizeof(CachedChunk *));
+    u32 n = 0;
+    for(u32 i = 0; i < io->pending_saves.capacity; i++) {
+        if(io->pending_saves.entries[i].value) {
+            chunks[n++] = io->pending_saves.entries[i].value;
+        }
+    }
+    clear_chunk_map(&io->pending_saves);
+
+    qsort(chunks, count, sizeof(CachedChunk *), compare_chunks);
+    for(u32 i = 0; i < count; i++) {
+        if(!region_write_chunk(&io->store, chunks[i]->pos, chunks[i]->data, chunks[i]->size)) {
+            fprintf(stderr, "Failed to save chunk %d, %d\n", chunks[i]->pos.x, chunks[i]->pos.y);
+        }
+        tracked_free(chunks[i]);
+    }
+    tracked_free(chunks);
+
+    atomic_fetch_add(&io->saves, count);
+    atomic_fetch_add(&io->save_batches, 1);
+}
+
+// Waits for a request, false if none came in for SAVE_DELAY_MS
+static bool wait_for_requests(ChunkIO *io) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += SAVE_DELAY_MS * NS_PER_MS;
+    deadline.tv_sec += deadline.tv_nsec / NS_PER_SECOND;
+    deadline.tv_nsec %= NS_PER_SECOND;
+
+    while(sem_timedwait(&io->wake, &deadline) != 0) {
+        if(errno != EINTR) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void *chunk_io_thread(void *arg) {
+    ChunkIO *io = arg;
+
+    while(true) {
+        bool idle = !wait_for_requests(io);
+        bool stopping = atomic_load(&io->stopping);
+        region_unmap_retired(&io->store, atomic_load(&io->completions_released));
+
+        // Everything queued so far is handled together, saves first so loads see them
+        u32 load_count = 0;
+        ChunkIOMessage request;
+        while(queue_pop(&io->requests, &request)) {
+            if(request.type == CHUNK_IO_SAVE) {
+                queue_save(io, request.chunk);
+            } else {
+                io->batch[load_count++] = request;
+            }
+        }
+
+        qsort(io->batch, load_count, sizeof(ChunkIOMessage), compare_messages);
+        for(u32 i = 0; i < load_count; i++) {
+            answer_load(io, io->batch[i].pos);
+        }
+
+        if(idle || stopping || io->pending_saves.count >= SAVE_BATCH_SIZE) {
+            write_pending_saves(io);
+        }
+
+        // The main thread sends nothing once stopping is set, so the queue is empty for good
+        if(stopping) {
+            return NULL;
+        }
+    }
+}
+
+bool init_chunk_io(ChunkIO *io, const char *dir) {
+    atomic_init(&io->requests.head, 0);
+    atomic_init(&io->requests.tail, 0);
+    atomic_init(&io->completions.head, 0);
+    atomic_init(&io->completions.tail, 0);
+    atomic_init(&io->stopping, false);
+    atomic_init(&io->loads, 0);
+    atomic_init(&io->saves, 0);
+    atomic_init(&io->save_batches, 0);
+    atomic_init(&io->completions_released, 0);
+    io->loads_in_flight = 0;
+    io->backlog = NULL;
+    io->backlog_count = 0;
+    io->backlog_allocated = 0;
+    io->completions_sent = 0;
+
+    init_region_store(&io->store, dir);
+    init_chunk_map(&io->pending_saves, SAVE_BATCH_SIZE * 2);
+
+    if(sem_init(&io->wake, 0, 0) != 0) {
+        fprintf(stderr, "Failed to create the chunk I/O semaphore\n");
+    } else if(pthread_create(&io->thread, NULL, chunk_io_thread, io) != 0) {
+        fprintf(stderr, "Failed to create the chunk I/O thread\n");
+        sem_destroy(&io->wake);
+    } else {
+        return true;
+    }
+
+    destroy_chunk_map(&io->pending_saves);
+    destroy_region_store(&io->store);
+    return false;
+}
+
+void destroy_chunk_io(ChunkIO *io) {
+    // The I/O thread keeps draining the ring, waiting is fine at shutdown
+    while(!flush_backlog(io)) {
+        sleep_microseconds(100);
+    }
+    tracked_free(io->backlog);
+    io->backlog = NULL;
+    io->backlog_allocated = 0;
+
+    atomic_store(&io->stopping, true);
+    sem_post(&io->wake);
+    pthread_join(io->thread, NULL);
+    sem_destroy(&io->wake);
+
+    ChunkIOMessage completion;
+    while(queue_pop(&io->completions, &completion)) {
+        tracked_free(completion.chunk);
+    }
+
+    destroy_chunk_map(&io->pending_saves);
+    destroy_region_store(&io->store);
+}
+
+bool chunk_io_can_load(const ChunkIO *io) {
+    return io->loads_in_flight < CHUNK_IO_QUEUE_SIZE;
+}
+
+void chunk_io_load(ChunkIO *io, ivec2s pos) {
+    io->loads_in_flight++;
+    send_request(io, (ChunkIOMessage) {CHUNK_IO_LOAD, pos, NULL});
+}
+
+void chunk_io_save(ChunkIO *io, CachedChunk *chunk) {
+    send_request(io, (ChunkIOMessage) {CHUNK_IO_SAVE, chunk->pos, chunk});
+}
+
+bool chunk_io_poll(ChunkIO *io, ChunkIOMessage *completion) {
+    if(io->backlog_count > 0) {
+        flush_backlog(io);
+    }
+
+    if(!queue_pop(&io->completions, completion)) {
+        return false;
+    }
+    io->loads_in_flight--;
+    return true;
+}
+
+void chunk_io_release(ChunkIO *io, ChunkIOMessage *completion) {
+    tracked_free(completion->chunk);
+    completion->chunk = NULL;
+    completion->data = NULL;
+    // Publishes that the data is no longer read
+    atomic_fetch_add_explicit(&io->completions_released, 1, memory_order_release);
+}
+
+void print_chunk_io_stats(const ChunkIO *io) {
+    u64 batches = atomic_load(&io->save_batches);
+    u64 saves = atomic_load(&io->saves);
+    printf(
+        "Chunk I/O: %lu loads, %lu saves in %lu batches (%.1f per batch)\n",
+        atomic_load(&io->loads),
+        saves,
+        batches,
+        batches ? (f64) saves / batches : 0.0);
+}
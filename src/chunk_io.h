@@ -0,0 +1,95 @@
+#ifndef _CHUNK_IO_H
+#define _CHUNK_IO_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "util.h"
+#include "chunk_cache.h"
+#include "chunk_map.h"
+#include "region.h"
+
+// Power of two
+#define CHUNK_IO_QUEUE_SIZE 1024
+
+typedef enum {
+    CHUNK_IO_LOAD,
+    CHUNK_IO_SAVE
+} ChunkIOType;
+
+typedef struct {
+    ChunkIOType type;
+    ivec2s pos;
+    // Save requests: the chunk to write, freed by the I/O thread
+    // Load completions: set if data is a copy instead of a view into the region file, freed by chunk_io_release()
+    CachedChunk *chunk;
+    // Load completions: the saved chunk or NULL if it was never saved, valid until chunk_io_release()
+    const u8 *data;
+    u32 size;
+    bool saved;
+} ChunkIOMessage;
+
+// Lock-free ring with one producer and one consumer
+typedef struct {
+    ChunkIOMessage messages[CHUNK_IO_QUEUE_SIZE];
+    // Only written by the consumer
+    _Alignas(CACHE_LINE_SIZE) _Atomic u32 head;
+    // Only written by the producer
+    _Alignas(CACHE_LINE_SIZE) _Atomic u32 tail;
+} ChunkIOQueue;
+
+// Region file access on a dedicated thread, the main thread sends requests and polls for loaded chunks
+typedef struct ChunkIO {
+    pthread_t thread;
+
+    // Main thread -> I/O thread
+    ChunkIOQueue requests;
+    // I/O thread -> main thread, only load completions
+    ChunkIOQueue completions;
+    // Posted for every request, extra posts only cause an empty wakeup
+    sem_t wake;
+    _Atomic bool stopping;
+
+    // Loads sent but not polled yet, kept below the completion queue size so the I/O thread never waits on it
+    // Main thread only
+    u32 loads_in_flight;
+    // Requests that did not fit in the ring, sent in order before any new one
+    // Main thread only
+    ChunkIOMessage *backlog;
+    u32 backlog_count;
+    u32 backlog_allocated;
+
+    // Region mappings are only unmapped once every completion that could point into them was released
+    // Only written by the main thread
+    _Atomic u64 completions_released;
+
+    // Owned by the I/O thread
+    RegionStore store;
+    // Saves waiting to be written in the next batch, by position
+    ChunkMap pending_saves;
+    ChunkIOMessage batch[CHUNK_IO_QUEUE_SIZE];
+    u64 completions_sent;
+
+    _Atomic u64 loads;
+    _Atomic u64 saves;
+    _Atomic u64 save_batches;
+} ChunkIO;
+
+bool init_chunk_io(ChunkIO *io, const char *dir);
+// Writes every pending save, loads that were not polled are dropped
+void destroy_chunk_io(ChunkIO *io);
+
+// False if too many loads are in flight, try again after polling
+bool chunk_io_can_load(const ChunkIO *io);
+void chunk_io_load(ChunkIO *io, ivec2s pos);
+// Takes ownership of the chunk, saves of the same chunk replace each other until the batch is written
+void chunk_io_save(ChunkIO *io, CachedChunk *chunk);
+// Returns false if no load has finished, also retries requests that did not fit in the ring
+bool chunk_io_poll(ChunkIO *io, ChunkIOMessage *completion);
+// Every polled completion has to be released once its data was read, in the order they were polled
+void chunk_io_release(ChunkIO *io, ChunkIOMessage *completion);
+
+void print_chunk_io_stats(const ChunkIO *io);
+
+#endif
@@ -0,0 +1,110 @@
+#include "chunk_map.h"
+#include "memory.h"
+
+#include <string.h>
+
+// Grow when more than 7/10 full
+#define MAX_LOAD_NUMERATOR 7
+#define MAX_LOAD_DENOMINATOR 10
+
+static u32 hash_key(ivec2s key) {
+    u32 h = (u32) key.x * 0x9E3779B1u ^ (u32) key.y * 0x85EBCA77u;
+    h ^= h >> 15;
+    h *= 0x2C1B3C6Du;
+    h ^= h >> 13;
+    return h;
+}
+
+static bool keys_equal(ivec2s a, ivec2s b) {
+    return a.x == b.x && a.y == b.y;
+}
+
+void init_chunk_map(ChunkMap *map, u32 capacity) {
+    u32 size = 16;
+    while(size < capacity) {
+        size *= 2;
+    }
+
+    map->entries = tracked_calloc(MEMORY_TAG_WORLD, size, sizeof(ChunkMapEntry));
+    map->capacity = size;
+    map->count = 0;
+}
+
+void destroy_chunk_map(ChunkMap *map) {
+    tracked_free(map->entries);
+    map->entries = NULL;
+    map->capacity = 0;
+    map->count = 0;
+}
+
+void clear_chunk_map(ChunkMap *map) {
+    memset(map->entries, 0, map->capacity * sizeof(ChunkMapEntry));
+    map->count = 0;
+}
+
+static u32 find_slot(const ChunkMap *map, ivec2s key) {
+    u32 mask = map->capacity - 1;
+    u32 slot = hash_key(key) & mask;
+    while(map->entries[slot].value && !keys_equal(map->entries[slot].key, key)) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+void *chunk_map_get(const ChunkMap *map, ivec2s key) {
+    return map->entries[find_slot(map, key)].value;
+}
+
+static void grow(ChunkMap *map) {
+    ChunkMapEntry *old_entries = map->entries;
+    u32 old_capacity = map->capacity;
+
+    map->capacity *= 2;
+    map->entries = tracked_calloc(MEMORY_TAG_WORLD, map->capacity, sizeof(ChunkMapEntry));
+
+    for(u32 i = 0; i < old_capacity; i++) {
+        if(old_entries[i].value) {
+            map->entries[find_slot(map, old_entries[i].key)] = old_entries[i];
+        }
+    }
+
+    tracked_free(old_entries);
+}
+
+void chunk_map_put(ChunkMap *map, ivec2s key, void *value) {
+    if((map->count + 1) * MAX_LOAD_DENOMINATOR > map->capacity * MAX_LOAD_NUMERATOR) {
+        grow(map);
+    }
+
+    u32 slot = find_slot(map, key);
+    if(!map->entries[slot].value) {
+        map->count++;
+    }
+    map->entries[slot] = (ChunkMapEntry) {key, value};
+}
+
+void *chunk_map_remove(ChunkMap *map, ivec2s key) {
+    u32 mask = map->capacity - 1;
+    u32 slot = find_slot(map, key);
+    void *value = map->entries[slot].value;
+    if(!value) {
+        return NULL;
+    }
+
+    // Backward shift deletion, moves later entries of the probe sequence into the gap so no tombstones are needed
+    u32 gap = slot;
+    u32 next = (gap + 1) & mask;
+    while(map->entries[next].value) {
+        u32 home = hash_key(map->entries[next].key) & mask;
+        // Distance from home to next is greater than from home to the gap, so the entry can move back
+        if(((next - home) & mask) >= ((next - gap) & mask)) {
+            map->entries[gap] = map->entries[next];
+            gap = next;
+        }
+        next = (next + 1) & mask;
+    }
+
+    map->entries[gap] = (ChunkMapEntry) {0};
+    map->count--;
+    return value;
+}
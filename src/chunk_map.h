@@ -0,0 +1,32 @@
+#ifndef _CHUNK_MAP_H
+#define _CHUNK_MAP_H
+
+#include "util.h"
+
+typedef struct {
+    ivec2s key;
+    // NULL marks an empty entry
+    void *value;
+} ChunkMapEntry;
+
+// Open addressing hash map from chunk positions to pointers, linear probing
+typedef struct {
+    ChunkMapEntry *entries;
+    // Power of two
+    u32 capacity;
+    u32 count;
+} ChunkMap;
+
+void init_chunk_map(ChunkMap *map, u32 capacity);
+void destroy_chunk_map(ChunkMap *map);
+
+// Removes every entry, keeps the capacity
+void clear_chunk_map(ChunkMap *map);
+
+void *chunk_map_get(const ChunkMap *map, ivec2s key);
+// value must not be NULL, replaces an existing value
+void chunk_map_put(ChunkMap *map, ivec2s key, void *value);
+// Returns the removed value or NULL
+void *chunk_map_remove(ChunkMap *map, ivec2s key);
+
+#endif
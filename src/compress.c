@@ -0,0 +1,73 @@
+#include "compress.h"
+
+// Control byte c: c < 128 means c + 1 literal bytes follow, otherwise the next byte repeats c - 126 times
+#define MAX_LITERAL 128
+// Shorter runs stay in the literal span, ending a span for a run of 2 saves nothing and costs a control byte
+#define MIN_RUN 3
+#define MAX_RUN 129
+
+u32 rle_compress(const u8 *src, u32 size, u8 *dest) {
+    u32 in = 0;
+    u32 out = 0;
+
+    while(in < size) {
+        u32 run = 1;
+        while(in + run < size && run < MAX_RUN && src[in + run] == src[in]) {
+            run++;
+        }
+
+        if(run >= MIN_RUN) {
+            dest[out++] = run + 126;
+            dest[out++] = src[in];
+            in += run;
+            continue;
+        }
+
+        // Literal span up to the next run of at least MIN_RUN
+        u32 start = in;
+        u32 length = 0;
+        while(in < size && length < MAX_LITERAL) {
+            if(in + 2 < size && src[in] == src[in + 1] && src[in] == src[in + 2]) {
+                break;
+            }
+            in++;
+            length++;
+        }
+
+        dest[out++] = length - 1;
+        for(u32 i = 0; i < length; i++) {
+            dest[out++] = src[start + i];
+        }
+    }
+
+    return out;
+}
+
+bool rle_decompress(const u8 *src, u32 size, u8 *dest, u32 dest_size) {
+    u32 in = 0;
+    u32 out = 0;
+
+    while(in < size) {
+        u8 control = src[in++];
+        if(control < MAX_LITERAL) {
+            u32 length = control + 1;
+            if(in + length > size || out + length > dest_size) {
+                return false;
+            }
+            for(u32 i = 0; i < length; i++) {
+                dest[out++] = src[in++];
+            }
+        } else {
+            u32 length = control - 126;
+            if(in >= size || out + length > dest_size) {
+                return false;
+            }
+            u8 value = src[in++];
+            for(u32 i = 0; i < length; i++) {
+                dest[out++] = value;
+            }
+        }
+    }
+
+    return out == dest_size;
+}
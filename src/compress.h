@@ -0,0 +1,15 @@
+#ifndef _COMPRESS_H
+#define _COMPRESS_H
+
+#include "util.h"
+
+// PackBits style run length encoding, runs of equal bytes and literal spans share one control byte
+// Incompressible data grows by at most 1 byte per 128, literal spans only end early at runs long enough to pay for the control byte
+#define RLE_BOUND(size) ((size) + ((size) + 127) / 128)
+
+// dest must hold RLE_BOUND(size) bytes, returns the compressed size
+u32 rle_compress(const u8 *src, u32 size, u8 *dest);
+// Returns false if the data is corrupt or does not decompress to exactly dest_size bytes
+bool rle_decompress(const u8 *src, u32 size, u8 *dest, u32 dest_size);
+
+#endif
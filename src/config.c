@@ -0,0 +1,207 @@
+#include "config.h"
+#include "world.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define DEFAULT_BACKGROUND_THREADS 2
+#define DEFAULT_CHUNK_BUDGET_MS 4
+#define DEFAULT_CHUNK_CACHE_MB 64
+
+Config config;
+
+static void print_usage(const char *program) {
+    printf(
+        "Usage: %s [options]\n"
+        "  --pin-threads             Pin threads using the detected CPU topology\n"
+        "  --main-core N             Pin the main thread to core N\n"
+        "  --render-cores LIST       Pin render workers to LIST, e.g. 1-7\n"
+        "  --background-cores LIST   Run chunk workers on LIST at a lower priority\n"
+        "  --background-threads N    Number of chunk workers (default %u)\n"
+        "  --load-distance N         Load N chunks around the player, 1-%u (default %u)\n"
+        "  --view-distance N         Draw N chunks around the player (default: load distance)\n"
+        "  --chunk-budget MS         Time per frame for chunk generation and meshing (default %u)\n"
+        "  --chunk-cache MB          Memory for unloaded chunks (default %u)\n"
+        "  --world DIR               Save the world to region files in DIR and load it from there\n"
+        "  --benchmark N             Render N frames without input, print timings and exit\n"
+        "  --help                    Show this message\n",
+        program,
+        DEFAULT_BACKGROUND_THREADS,
+        MAX_LOAD_DISTANCE,
+        DEFAULT_LOAD_DISTANCE,
+        DEFAULT_CHUNK_BUDGET_MS,
+        DEFAULT_CHUNK_CACHE_MB);
+}
+
+static bool parse_u32_arg(const char *option, const char *value, u32 *out) {
+    char *end = NULL;
+    if(value) {
+        *out = strtoul(value, &end, 10);
+    }
+    if(!value || end == value || *end != '\0') {
+        fprintf(stderr, "Invalid value for %s\n", option);
+        return false;
+    }
+    return true;
+}
+
+static bool parse_core_set_arg(const char *option, const char *value, CoreSet *set) {
+    if(!value || !parse_core_set(value, set)) {
+        fprintf(stderr, "Invalid core list for %s\n", option);
+        return false;
+    }
+    return true;
+}
+
+bool parse_config(i32 argc, char **argv) {
+    config = (Config) {0};
+    config.render_affinity.one_core_per_thread = true;
+    config.background_affinity.low_priority = true;
+    config.background_threads = DEFAULT_BACKGROUND_THREADS;
+    config.load_distance = DEFAULT_LOAD_DISTANCE;
+    config.chunk_budget_ms = DEFAULT_CHUNK_BUDGET_MS;
+    config.chunk_cache_mb = DEFAULT_CHUNK_CACHE_MB;
+
+    for(i32 i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if(strcmp(arg, "--pin-threads") == 0) {
+            config.auto_pin = true;
+        } else if(strcmp(arg, "--main-core") == 0) {
+            if(!parse_u32_arg(arg, value, &config.main_core)) {
+                return false;
+            }
+            config.pin_main_thread = true;
+            i++;
+        } else if(strcmp(arg, "--render-cores") == 0) {
+            if(!parse_core_set_arg(arg, value, &config.render_affinity.cores)) {
+                return false;
+            }
+            i++;
+        } else if(strcmp(arg, "--background-cores") == 0) {
+            if(!parse_core_set_arg(arg, value, &config.background_affinity.cores)) {
+                return false;
+            }
+            i++;
+        } else if(strcmp(arg, "--background-threads") == 0) {
+            if(!parse_u32_arg(arg, value, &config.background_threads)) {
+                return false;
+            }
+            if(config.background_threads < 1) {
+                fprintf(stderr, "At least one background thread is required\n");
+                return false;
+            }
+            i++;
+        } else if(strcmp(arg, "--load-distance") == 0) {
+            if(!parse_u32_arg(arg, value, &config.load_distance)) {
+                return false;
+            }
+            if(config.load_distance < 1 || config.load_distance > MAX_LOAD_DISTANCE) {
+                fprintf(stderr, "Load distance must be between 1 and %u\n", MAX_LOAD_DISTANCE);
+                return false;
+            }
+            i++;
+        } else if(strcmp(arg, "--view-distance") == 0) {
+            if(!parse_u32_arg(arg, value, &config.view_distance)) {
+                return false;
+            }
+            i++;
+        } else if(strcmp(arg, "--chunk-budget") == 0) {
+            if(!parse_u32_arg(arg, value, &config.chunk_budget_ms)) {
+                return false;
+            }
+            i++;
+        } else if(strcmp(arg, "--chunk-cache") == 0) {
+            if(!parse_u32_arg(arg, value, &config.chunk_cache_mb)) {
+                return false;
+            }
+            i++;
+        } else if(strcmp(arg, "--world") == 0) {
+            if(!value) {
+                fprintf(stderr, "Missing directory for %s\n", arg);
+                return false;
+            }
+            config.world_dir = value;
+            i++;
+        } else if(strcmp(arg, "--benchmark") == 0) {
+            if(!parse_u32_arg(arg, value, &config.benchmark_frames)) {
+                return false;
+            }
+            i++;
+        } else if(strcmp(arg, "--help") == 0) {
+            print_usage(argv[0]);
+            return false;
+        } else {
+            fprintf(stderr, "Unknown option %s\n", arg);
+            print_usage(argv[0]);
+            return false;
+        }
+    }
+
+    if(config.view_distance == 0 || config.view_distance > config.load_distance) {
+        config.view_distance = config.load_distance;
+    }
+
+    return true;
+}
+
+void configure_thread_layout(const Topology *topology) {
+    if(!config.auto_pin) {
+        return;
+    }
+
+    u32 cpus = topology->logical_cpus;
+    if(cpus < 3) {
+        // Not enough cores to split, leave it to the scheduler
+        return;
+    }
+
+    // Main thread gets core 0, a quarter of the rest goes to background work
+    u32 background_count = (cpus - 1) / 4 > 0 ? (cpus - 1) / 4 : 1;
+    u32 render_first = 1;
+    u32 render_last = cpus - 1 - background_count;
+
+    if(!config.pin_main_thread) {
+        config.pin_main_thread = true;
+        config.main_core = 0;
+    }
+
+    if(config.render_affinity.cores.count == 0) {
+        for(u32 core = render_first; core <= render_last; core++) {
+            core_set_add(&config.render_affinity.cores, core);
+        }
+    }
+
+    if(config.background_affinity.cores.count == 0) {
+        for(u32 core = render_last + 1; core < cpus; core++) {
+            core_set_add(&config.background_affinity.cores, core);
+        }
+    }
+}
+
+static void print_core_set(const char *name, const CoreSet *set) {
+    printf("  %s: ", name);
+    if(set->count == 0) {
+        printf("any\n");
+        return;
+    }
+
+    for(u32 i = 0; i < set->count; i++) {
+        printf(i == 0 ? "%u" : ",%u", set->cores[i]);
+    }
+    printf("\n");
+}
+
+void print_thread_layout() {
+    printf("Thread layout:\n");
+    if(config.pin_main_thread) {
+        printf("  main: %u\n", config.main_core);
+    } else {
+        printf("  main: any\n");
+    }
+    print_core_set("render", &config.render_affinity.cores);
+    print_core_set("background", &config.background_affinity.cores);
+    printf("  background threads: %u\n", config.background_threads);
+}
@@ -0,0 +1,44 @@
+#ifndef _CONFIG_H
+#define _CONFIG_H
+
+#include "util.h"
+#include "topology.h"
+
+typedef struct {
+    // Pin render workers/main thread/background workers using the detected topology
+    bool auto_pin;
+
+    bool pin_main_thread;
+    u32 main_core;
+
+    ThreadAffinity render_affinity;
+    ThreadAffinity background_affinity;
+
+    // Workers for chunk generation/meshing
+    u32 background_threads;
+
+    // In chunks, view_distance 0 means the same as the load distance
+    u32 load_distance;
+    u32 view_distance;
+    // Time per frame spent generating and meshing chunks
+    u32 chunk_budget_ms;
+
+    // Memory for compressed unloaded chunks, in MB
+    u32 chunk_cache_mb;
+    // Region files of the world, NULL does not save it
+    const char *world_dir;
+
+    // If non-zero, render this many frames without input, print timings and exit
+    u32 benchmark_frames;
+} Config;
+
+extern Config config;
+
+// Returns false if the program should exit
+bool parse_config(i32 argc, char **argv);
+
+// Fills in the thread layout for --pin-threads, explicit core lists take precedence
+void configure_thread_layout(const Topology *topology);
+void print_thread_layout();
+
+#endif
@@ -11,9 +11,18 @@
 #include "world.h"
 #include "player.h"
 #include "thread_pool.h"
+#include "config.h"
+#include "topology.h"
+#include "memory.h"
 
 #define COS_40_DEG 0.766
 
+// Frames rendered before benchmark timing starts, lets the initial chunks load and mesh
+#define BENCHMARK_WARMUP_FRAMES 120
+// Fixed benchmark view, looking down at the terrain
+#define BENCHMARK_PITCH -40.0f
+#define BENCHMARK_YAW 45.0f
+
 struct {
     RenderState *render_state;
     World *world;
@@ -21,9 +30,38 @@ struct {
     bool quit;
 } state;
 
-int main() {
+static void print_render_stats(RenderStats stats) {
+    if(stats.frames == 0) {
+        return;
+    }
+
+    f64 frames = stats.frames;
+    printf(
+        "Raster: %.2f ms/frame, sections avg %.2f ms, slowest %.2f ms, %lu heap allocations\n",
+        stats.raster_ns / frames / 1e6,
+        stats.section_ns / frames / RENDER_THREAD_COUNT / 1e6,
+        stats.slowest_section_ns / frames / 1e6,
+        stats.heap_allocations);
+}
+
+int main(int argc, char **argv) {
     state.quit = false;
 
+    if(!parse_config(argc, argv)) {
+        return 0;
+    }
+
+    init_memory_tracking();
+
+    Topology topology = detect_topology();
+    print_topology(&topology);
+    configure_thread_layout(&topology);
+    print_thread_layout();
+
+    if(config.pin_main_thread) {
+        pin_thread(pthread_self(), &config.main_core, 1);
+    }
+
     Window window = init_window("Wcraft", (ivec2s) {854, 480});
 
     state.render_state = init_rendering(&window);
@@ -35,13 +73,18 @@ int main() {
     set_clear_color(0, 0, 0, 0xFF);
 
     Texture texture = load_texture("resources/texture.png");
+    texture.tile_size = (vec2s) {ATLAS_TILE_SIZE, ATLAS_TILE_SIZE};
     state.atlas = &texture;
 
     init_player();
 
     init_blocks();
 
-    World *world = init_world();
+    World *world = init_world(
+        config.load_distance,
+        config.view_distance,
+        (u64) config.chunk_cache_mb * 1024 * 1024,
+        config.world_dir);
     state.world = world;
     world_set(&blocks[BLOCK_COBBLESTONE], 100, 31, 100);
 
@@ -51,11 +94,25 @@ int main() {
     u64 last_second = ns_now();
     u32 frames = 0;
 
+    bool benchmark = config.benchmark_frames > 0;
+    u32 benchmark_frame = 0;
+    u64 benchmark_start = 0;
+    // Benchmark runs ignore the keyboard so every run sees the same frames
+    static const u8 no_keys[512] = {0};
+    if(benchmark) {
+        player.camera.pitch = BENCHMARK_PITCH;
+        player.camera.yaw = BENCHMARK_YAW;
+    }
+
     while(!state.quit) {
         window.mouse.movement = (vec2s) {0.0f, 0.0f};
 
         SDL_Event event;
         while(SDL_PollEvent(&event)) {
+            if(benchmark && event.type != SDL_EVENT_QUIT) {
+                continue;
+            }
+
             switch(event.type) {
                 case SDL_EVENT_QUIT:
                     state.quit = true;
@@ -74,6 +131,14 @@ int main() {
                 case SDL_EVENT_KEY_DOWN:
                     if(event.key.keysym.scancode <= SDL_GetScancodeFromKey(SDLK_9) && event.key.keysym.scancode >= SDL_GetScancodeFromKey(SDLK_1)) {
                         player.hotbar_slot = event.key.keysym.scancode - 29;
+                    } else if(event.key.keysym.scancode == SDL_SCANCODE_MINUS) {
+                        set_load_distance(world->load_distance - 1);
+                    } else if(event.key.keysym.scancode == SDL_SCANCODE_EQUALS) {
+                        set_load_distance(world->load_distance + 1);
+                    } else if(event.key.keysym.scancode == SDL_SCANCODE_LEFTBRACKET) {
+                        set_view_distance(world->view_distance - 1);
+                    } else if(event.key.keysym.scancode == SDL_SCANCODE_RIGHTBRACKET) {
+                        set_view_distance(world->view_distance + 1);
                     }
                     break;
                 default:
@@ -88,26 +153,33 @@ int main() {
 
         update_keys(&window);
 
+        player.camera.far_plane = view_far_plane();
         update_camera(&player.camera, &window);
-        update_player(timestep, window.keys);
+        update_player(timestep, benchmark ? no_keys : window.keys);
+
+        update_world(config.chunk_budget_ms * NS_PER_MS);
+        begin_frame();
 
-        update_world();
-        
         mat4s view = player.camera.view;
         mat4s proj = player.camera.proj;
 
-        for(u32 i = 0; i < world->chunk_count; i++) {
-            Chunk *chunk = world->chunks[i];
-            if(chunk) {
-                draw_triangles(
-                chunk->mesh.vertex_count / 3,
-                chunk->mesh.vertices,
-                &texture,
-                proj,
-                view,
-                glms_translate(
-                    glms_mat4_identity(),
-                    (vec3s) {chunk->pos.x * 16, 0, chunk->pos.y * 16}));            
+        vec4s frustum_planes[6];
+        glms_frustum_planes(glms_mat4_mul(proj, view), frustum_planes);
+
+        for(u32 i = 0; i < SQ(world->load_width); i++) {
+            Chunk *chunk = &world->chunks[i];
+            if(!chunk_visible(chunk, frustum_planes)) {
+                continue;
+            }
+
+            mat4s model = glms_translate(
+                glms_mat4_identity(),
+                (vec3s) {chunk->pos.x * 16, 0, chunk->pos.y * 16});
+            for(u32 j = 0; j < SECTION_COUNT; j++) {
+                const MeshBuffer *mesh = &chunk->mesh.front[j];
+                if(mesh->vertex_count > 0) {
+                    draw_packed_quads(mesh->vertex_count / 4, mesh->vertices, &texture, proj, view, model);
+                }
             }
         }
         draw_screen();
@@ -116,12 +188,37 @@ int main() {
         u64 now = ns_now();
         if(now - last_second > NS_PER_SECOND) {
             printf("FPS: %u\n", frames);
+            if(!benchmark) {
+                print_render_stats(get_render_stats());
+                reset_render_stats();
+            }
             frames = 0;
             last_second = now;
         }
         
         render_wait();
         present();
+
+        if(benchmark) {
+            benchmark_frame++;
+            if(benchmark_frame == BENCHMARK_WARMUP_FRAMES) {
+                reset_render_stats();
+                benchmark_start = ns_now();
+            } else if(benchmark_frame == BENCHMARK_WARMUP_FRAMES + config.benchmark_frames) {
+                RenderStats stats = get_render_stats();
+                printf(
+                    "Benchmark: %u frames, %.2f ms/frame\n",
+                    config.benchmark_frames,
+                    (ns_now() - benchmark_start) / (f64) config.benchmark_frames / 1e6);
+                print_render_stats(stats);
+                state.quit = true;
+            }
+        }
+    }
+
+    print_chunk_cache_stats(&world->chunk_cache);
+    if(world->persistent) {
+        print_chunk_io_stats(&world->chunk_io);
     }
 
     destroy_world();
@@ -129,5 +226,8 @@ int main() {
     destroy_window(&window);
     destroy_texture(&texture);
 
+    // After teardown, so current bytes are leaks
+    print_memory_stats();
+
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,151 @@
+#include "memory.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+// Stored in front of every tracked allocation, 16 bytes to keep malloc's alignment
+typedef struct {
+    u64 size;
+    u32 tag;
+    u32 padding;
+} AllocationHeader;
+
+typedef struct {
+    _Atomic u64 current_bytes;
+    _Atomic u64 peak_bytes;
+    _Atomic u64 allocations;
+    _Atomic u64 frees;
+
+    // Only touched by memory_allocation_rate
+    u64 last_allocations;
+    u64 last_time;
+} TagStats;
+
+static TagStats tag_stats[MEMORY_TAG_COUNT];
+
+static const char *tag_names[MEMORY_TAG_COUNT] = {
+    [MEMORY_TAG_WORLD] = "world",
+    [MEMORY_TAG_RENDERING] = "rendering",
+    [MEMORY_TAG_THREAD_POOL] = "thread pool",
+    [MEMORY_TAG_TEXTURE] = "texture"
+};
+
+static void track_alloc(MemoryTag tag, u64 size) {
+    TagStats *stats = &tag_stats[tag];
+    atomic_fetch_add(&stats->allocations, 1);
+    u64 current = atomic_fetch_add(&stats->current_bytes, size) + size;
+
+    u64 peak = atomic_load(&stats->peak_bytes);
+    while(current > peak && !atomic_compare_exchange_weak(&stats->peak_bytes, &peak, current)) {}
+}
+
+static void track_free(MemoryTag tag, u64 size) {
+    TagStats *stats = &tag_stats[tag];
+    atomic_fetch_add(&stats->frees, 1);
+    atomic_fetch_sub(&stats->current_bytes, size);
+}
+
+static void *init_header(void *block, MemoryTag tag, u64 size) {
+    if(!block) {
+        return NULL;
+    }
+
+    AllocationHeader *header = block;
+    header->size = size;
+    header->tag = tag;
+    return header + 1;
+}
+
+void *tracked_malloc(MemoryTag tag, u64 size) {
+    void *ptr = init_header(malloc(sizeof(AllocationHeader) + size), tag, size);
+    if(ptr) {
+        track_alloc(tag, size);
+    }
+    return ptr;
+}
+
+void *tracked_calloc(MemoryTag tag, u64 count, u64 size) {
+    void *ptr = init_header(calloc(1, sizeof(AllocationHeader) + count * size), tag, count * size);
+    if(ptr) {
+        track_alloc(tag, count * size);
+    }
+    return ptr;
+}
+
+void *tracked_realloc(MemoryTag tag, void *ptr, u64 size) {
+    if(!ptr) {
+        return tracked_malloc(tag, size);
+    }
+
+    AllocationHeader *header = (AllocationHeader*) ptr - 1;
+    u64 old_size = header->size;
+    MemoryTag old_tag = header->tag;
+
+    void *new_ptr = init_header(realloc(header, sizeof(AllocationHeader) + size), tag, size);
+    if(new_ptr) {
+        track_free(old_tag, old_size);
+        track_alloc(tag, size);
+    }
+    return new_ptr;
+}
+
+void tracked_free(void *ptr) {
+    if(!ptr) {
+        return;
+    }
+
+    AllocationHeader *header = (AllocationHeader*) ptr - 1;
+    track_free(header->tag, header->size);
+    free(header);
+}
+
+void init_memory_tracking() {
+    u64 now = ns_now();
+    for(u32 i = 0; i < MEMORY_TAG_COUNT; i++) {
+        tag_stats[i].last_time = now;
+        tag_stats[i].last_allocations = atomic_load(&tag_stats[i].allocations);
+    }
+}
+
+const char *memory_tag_name(MemoryTag tag) {
+    return tag_names[tag];
+}
+
+MemoryStats get_memory_stats(MemoryTag tag) {
+    TagStats *stats = &tag_stats[tag];
+    return (MemoryStats) {
+        .current_bytes = atomic_load(&stats->current_bytes),
+        .peak_bytes = atomic_load(&stats->peak_bytes),
+        .allocations = atomic_load(&stats->allocations),
+        .frees = atomic_load(&stats->frees)
+    };
+}
+
+f64 memory_allocation_rate(MemoryTag tag) {
+    TagStats *stats = &tag_stats[tag];
+    u64 now = ns_now();
+    u64 allocations = atomic_load(&stats->allocations);
+
+    f64 seconds = (now - stats->last_time) / (f64) NS_PER_SECOND;
+    f64 rate = seconds > 0.0 ? (allocations - stats->last_allocations) / seconds : 0.0;
+    stats->last_time = now;
+    stats->last_allocations = allocations;
+    return rate;
+}
+
+void print_memory_stats() {
+    printf("Memory:\n");
+    for(u32 i = 0; i < MEMORY_TAG_COUNT; i++) {
+        MemoryStats stats = get_memory_stats(i);
+        printf(
+            "  %-12s current %8.2f MB, peak %8.2f MB, %lu allocations, %lu frees, %.1f allocations/s\n",
+            memory_tag_name(i),
+            stats.current_bytes / (1024.0 * 1024.0),
+            stats.peak_bytes / (1024.0 * 1024.0),
+            stats.allocations,
+            stats.frees,
+            memory_allocation_rate(i));
+    }
+}
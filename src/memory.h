@@ -0,0 +1,39 @@
+#ifndef _MEMORY_H
+#define _MEMORY_H
+
+#include "util.h"
+
+// Subsystem an allocation is accounted to
+typedef enum {
+    MEMORY_TAG_WORLD = 0,
+    MEMORY_TAG_RENDERING,
+    MEMORY_TAG_THREAD_POOL,
+    MEMORY_TAG_TEXTURE,
+    MEMORY_TAG_COUNT
+} MemoryTag;
+
+typedef struct {
+    u64 current_bytes;
+    u64 peak_bytes;
+    u64 allocations;
+    u64 frees;
+} MemoryStats;
+
+// Starts the clock for allocation rates
+void init_memory_tracking();
+
+// Drop-in replacements for malloc/calloc/realloc/free that keep per-tag statistics
+// Memory from these must only be freed with tracked_free
+void *tracked_malloc(MemoryTag tag, u64 size);
+void *tracked_calloc(MemoryTag tag, u64 count, u64 size);
+void *tracked_realloc(MemoryTag tag, void *ptr, u64 size);
+void tracked_free(void *ptr);
+
+const char *memory_tag_name(MemoryTag tag);
+MemoryStats get_memory_stats(MemoryTag tag);
+// Allocations per second since the previous call (or since init_memory_tracking)
+f64 memory_allocation_rate(MemoryTag tag);
+
+void print_memory_stats();
+
+#endif
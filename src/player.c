@@ -32,13 +32,16 @@ static void move_xz(vec3s original_pos, vec3s delta, f32 speed) {
     i32 block_pos_y = floorf(original_pos.y);
     i32 block_pos_z = floorf(original_pos.z);
 
+    BlockAccessor accessor;
+    init_block_accessor(&accessor);
+
     vec3s scaled_delta = glms_vec3_scale(delta, speed);
     player.pos.x += scaled_delta.x;
 
     for(i32 x = block_pos_x - 2; x <= block_pos_x + 2; x++) {
         for(i32 y = block_pos_y - 2; y <= block_pos_y + 3; y++) {
             for(i32 z = block_pos_z - 2; z <= block_pos_z + 2; z++) {
-                Block *block = world_get(x, y, z);
+                Block *block = accessor_get(&accessor, x, y, z);
                 if(block && block->solid) {
                     AABB player_aabb = (AABB) {
                         .pos = (vec3s) {
@@ -71,7 +74,7 @@ static void move_xz(vec3s original_pos, vec3s delta, f32 speed) {
     for(i32 x = block_pos_x - 2; x <= block_pos_x + 2; x++) {
         for(i32 y = block_pos_y - 2; y <= block_pos_y + 3; y++) {
             for(i32 z = block_pos_z - 2; z <= block_pos_z + 2; z++) {
-                Block *block = world_get(x, y, z);
+                Block *block = accessor_get(&accessor, x, y, z);
                 if(block && block->solid) {
                     AABB player_aabb = (AABB) {
                         .pos = (vec3s) {
@@ -107,12 +110,15 @@ static void move_y(vec3s original_pos, f32 delta_y, f32 speed) {
     i32 block_pos_y = floorf(original_pos.y);
     i32 block_pos_z = floorf(original_pos.z);
 
+    BlockAccessor accessor;
+    init_block_accessor(&accessor);
+
     player.pos.y += delta_y * speed;
 
     for(i32 x = block_pos_x - 2; x <= block_pos_x + 2; x++) {
         for(i32 y = block_pos_y - 2; y <= block_pos_y + 3; y++) {
             for(i32 z = block_pos_z - 2; z <= block_pos_z + 2; z++) {
-                Block *block = world_get(x, y, z);
+                Block *block = accessor_get(&accessor, x, y, z);
                 if(block && block->solid) {
                     AABB player_aabb = (AABB) {
                         .pos = (vec3s) {
@@ -193,13 +199,16 @@ static Block *raycast(vec3s dir, f32 distance, ivec3s *out_pos, ivec3s *last_pos
 
     vec3s current_pos = player.camera.pos;
 
+    BlockAccessor accessor;
+    init_block_accessor(&accessor);
+
     for(f32 distance_travelled = 0.0f; distance_travelled < distance; distance_travelled += delta_magnitude) {
         // Fast floor
         i32 block_pos_x = floorf(current_pos.x);
         i32 block_pos_y = floorf(current_pos.y);
         i32 block_pos_z = floorf(current_pos.z);
 
-        Block *block = world_get(block_pos_x, block_pos_y, block_pos_z);
+        Block *block = accessor_get(&accessor, block_pos_x, block_pos_y, block_pos_z);
         if(block && block->type != BLOCK_AIR) {
             if(out_pos) {
                 *out_pos = (ivec3s) {
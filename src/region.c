@@ -0,0 +1,309 @@
+// pread() and pwrite() are newer than the POSIX version the build asks for
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include "region.h"
+#include "memory.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Offsets are stored as u32
+#define MAX_REGION_FILE_SIZE UINT32_MAX
+// Mappings extend past the end of the file so appends rarely need a new one
+#define REGION_MAP_GRANULE (1024 * 1024)
+// Files with more replaced payloads than this and than live ones are compacted when opened
+#define MIN_COMPACT_GARBAGE (1024 * 1024)
+
+ivec2s region_of_chunk(ivec2s chunk_pos) {
+    return (ivec2s) {{
+        (chunk_pos.x - MOD(chunk_pos.x, REGION_SIZE)) / REGION_SIZE,
+        (chunk_pos.y - MOD(chunk_pos.y, REGION_SIZE)) / REGION_SIZE
+    }};
+}
+
+static u32 region_index(ivec2s chunk_pos) {
+    return MOD(chunk_pos.x, REGION_SIZE) + MOD(chunk_pos.y, REGION_SIZE) * REGION_SIZE;
+}
+
+static void region_path(const RegionStore *store, ivec2s pos, char *path, u32 size) {
+    snprintf(path, size, "%s/r.%d.%d.region", store->dir, pos.x, pos.y);
+}
+
+void init_region_store(RegionStore *store, const char *dir) {
+    *store = (RegionStore) {0};
+    store->dir = dir;
+
+    // Fails harmlessly if it already exists
+    mkdir(dir, 0755);
+}
+
+// Payloads handed out from the mapping may still be read, it is unmapped by region_unmap_retired()
+static void retire_mapping(RegionStore *store, Region *region) {
+    if(!region->map) {
+        return;
+    }
+
+    if(store->retired_count >= store->retired_allocated) {
+        store->retired_allocated = store->retired_allocated ? store->retired_allocated * 2 : 8;
+        store->retired = tracked_realloc(MEMORY_TAG_WORLD, store->retired, store->retired_allocated * sizeof(RetiredMapping));
+    }
+    store->retired[store->retired_count++] = (RetiredMapping) {region->map, region->map_size, store->epoch};
+
+    region->map = NULL;
+    region->map_size = 0;
+}
+
+void region_unmap_retired(RegionStore *store, u64 epoch) {
+    u32 kept = 0;
+    for(u32 i = 0; i < store->retired_count; i++) {
+        RetiredMapping *retired = &store->retired[i];
+        if(retired->epoch <= epoch) {
+            munmap((void *) retired->map, retired->size);
+        } else {
+            store->retired[kept++] = *retired;
+        }
+    }
+    store->retired_count = kept;
+}
+
+// Maps everything written so far, false if the file can not be mapped
+static bool map_region(RegionStore *store, Region *region) {
+    retire_mapping(store, region);
+
+    // Pages past the end of the file are never read, payloads are only read below region->end
+    u64 size = ALIGN_UP(region->end, REGION_MAP_GRANULE);
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, region->fd, 0);
+    if(map == MAP_FAILED) {
+        return false;
+    }
+    region->map = map;
+    region->map_size = size;
+
+    // Chunks of a region are usually loaded together, start reading them in now
+    posix_madvise(map, region->end, POSIX_MADV_WILLNEED);
+    return true;
+}
+
+static void close_region(RegionStore *store, Region *region) {
+    retire_mapping(store, region);
+    if(region->fd >= 0) {
+        close(region->fd);
+    }
+    tracked_free(region);
+}
+
+void destroy_region_store(RegionStore *store) {
+    for(u32 i = 0; i < store->region_count; i++) {
+        close_region(store, store->regions[i]);
+    }
+    store->region_count = 0;
+
+    // Nothing reads from the store anymore
+    region_unmap_retired(store, UINT64_MAX);
+    tracked_free(store->retired);
+    store->retired = NULL;
+    store->retired_allocated = 0;
+
+    tracked_free(store->read_buffer);
+    store->read_buffer = NULL;
+    store->read_buffer_size = 0;
+}
+
+// Reads the header, entries pointing outside the file are dropped
+static bool read_header(Region *region) {
+    struct stat st;
+    if(fstat(region->fd, &st) != 0) {
+        return false;
+    }
+
+    if((u64) st.st_size < REGION_HEADER_SIZE) {
+        // New or truncated file, start over with an empty header
+        memset(region->entries, 0, REGION_HEADER_SIZE);
+        region->end = REGION_HEADER_SIZE;
+        return pwrite(region->fd, region->entries, REGION_HEADER_SIZE, 0) == (ssize_t) REGION_HEADER_SIZE;
+    }
+
+    if(pread(region->fd, region->entries, REGION_HEADER_SIZE, 0) != (ssize_t) REGION_HEADER_SIZE) {
+        return false;
+    }
+    region->end = st.st_size;
+
+    for(u32 i = 0; i < REGION_CHUNK_COUNT; i++) {
+        RegionEntry *entry = &region->entries[i];
+        if(entry->offset != 0
+            && (entry->offset < REGION_HEADER_SIZE || (u64) entry->offset + entry->size > region->end)) {
+            *entry = (RegionEntry) {0};
+        }
+    }
+    return true;
+}
+
+static const u8 *read_payload(RegionStore *store, Region *region, const RegionEntry *entry) {
+    if(store->read_buffer_size < entry->size) {
+        tracked_free(store->read_buffer);
+        store->read_buffer = tracked_malloc(MEMORY_TAG_WORLD, entry->size);
+        store->read_buffer_size = entry->size;
+    }
+
+    if(pread(region->fd, store->read_buffer, entry->size, entry->offset) != (ssize_t) entry->size) {
+        return NULL;
+    }
+    return store->read_buffer;
+}
+
+// Copies the live payloads into a new file that replaces the old one, a crash before the rename keeps the old file
+// Only called while nothing maps the region, mappings retired from the old file keep its data
+static void compact_region_file(RegionStore *store, Region *region, const char *path) {
+    char temp_path[520];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    int fd = open(temp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        return;
+    }
+
+    RegionEntry entries[REGION_CHUNK_COUNT];
+    u64 end = REGION_HEADER_SIZE;
+    bool ok = true;
+    for(u32 i = 0; i < REGION_CHUNK_COUNT && ok; i++) {
+        entries[i] = region->entries[i];
+        if(entries[i].offset == 0) {
+            continue;
+        }
+
+        const u8 *data = read_payload(store, region, &entries[i]);
+        ok = data && pwrite(fd, data, entries[i].size, end) == (ssize_t) entries[i].size;
+        entries[i].offset = end;
+        end += entries[i].size;
+    }
+
+    ok = ok
+        && pwrite(fd, entries, REGION_HEADER_SIZE, 0) == (ssize_t) REGION_HEADER_SIZE
+        && fsync(fd) == 0
+        && rename(temp_path, path) == 0;
+    if(!ok) {
+        close(fd);
+        unlink(temp_path);
+        return;
+    }
+
+    close(region->fd);
+    region->fd = fd;
+    region->end = end;
+    memcpy(region->entries, entries, REGION_HEADER_SIZE);
+}
+
+// Opens the file of a region, creating it only if create is set
+static bool open_region_file(RegionStore *store, Region *region, bool create) {
+    char path[512];
+    region_path(store, region->pos, path, sizeof(path));
+
+    region->fd = open(path, O_RDWR | (create ? O_CREAT : 0), 0644);
+    if(region->fd < 0) {
+        if(errno != ENOENT) {
+            fprintf(stderr, "Failed to open %s\n", path);
+        }
+        return false;
+    }
+
+    if(!read_header(region)) {
+        fprintf(stderr, "Failed to read the header of %s\n", path);
+        close(region->fd);
+        region->fd = -1;
+        return false;
+    }
+
+    u64 live = 0;
+    for(u32 i = 0; i < REGION_CHUNK_COUNT; i++) {
+        live += region->entries[i].size;
+    }
+    u64 garbage = region->end - REGION_HEADER_SIZE - live;
+    if(garbage > MIN_COMPACT_GARBAGE && garbage > live) {
+        compact_region_file(store, region, path);
+    }
+    return true;
+}
+
+static Region *get_region(RegionStore *store, ivec2s chunk_pos, bool create) {
+    ivec2s pos = region_of_chunk(chunk_pos);
+    Region *region = NULL;
+
+    for(u32 i = 0; i < store->region_count; i++) {
+        if(store->regions[i]->pos.x == pos.x && store->regions[i]->pos.y == pos.y) {
+            region = store->regions[i];
+            break;
+        }
+    }
+
+    if(!region) {
+        if(store->region_count == MAX_OPEN_REGIONS) {
+            u32 oldest = 0;
+            for(u32 i = 1; i < store->region_count; i++) {
+                if(store->regions[i]->last_used < store->regions[oldest]->last_used) {
+                    oldest = i;
+                }
+            }
+            close_region(store, store->regions[oldest]);
+            store->regions[oldest] = store->regions[--store->region_count];
+        }
+
+        // Regions without a file are remembered too so lookups in unexplored terrain do not hit the disk
+        region = tracked_calloc(MEMORY_TAG_WORLD, 1, sizeof(Region));
+        region->pos = pos;
+        region->fd = -1;
+        open_region_file(store, region, create);
+        store->regions[store->region_count++] = region;
+    } else if(region->fd < 0 && create) {
+        open_region_file(store, region, true);
+    }
+
+    region->last_used = ++store->clock;
+    return region;
+}
+
+const u8 *region_chunk_data(RegionStore *store, ivec2s pos, u32 *size, bool *mapped) {
+    Region *region = get_region(store, pos, false);
+    const RegionEntry *entry = &region->entries[region_index(pos)];
+    if(region->fd < 0 || entry->offset == 0) {
+        return NULL;
+    }
+
+    *size = entry->size;
+    *mapped = (u64) entry->offset + entry->size <= region->map_size || map_region(store, region);
+    if(*mapped) {
+        return region->map + entry->offset;
+    }
+    return read_payload(store, region, entry);
+}
+
+bool region_write_chunk(RegionStore *store, ivec2s pos, const u8 *data, u32 size) {
+    Region *region = get_region(store, pos, true);
+    if(region->fd < 0) {
+        return false;
+    }
+
+    if(region->end + size > MAX_REGION_FILE_SIZE) {
+        fprintf(stderr, "Region %d, %d is full\n", region->pos.x, region->pos.y);
+        return false;
+    }
+
+    // Never over the old payload, a torn write would lose the only copy and mapped views still read it
+    // The payload is written before the header points at it
+    u32 index = region_index(pos);
+    RegionEntry entry = {(u32) region->end, size};
+    if(pwrite(region->fd, data, size, entry.offset) != (ssize_t) size) {
+        return false;
+    }
+    region->end += size;
+
+    if(pwrite(region->fd, &entry, sizeof(RegionEntry), index * sizeof(RegionEntry)) != (ssize_t) sizeof(RegionEntry)) {
+        return false;
+    }
+    region->entries[index] = entry;
+    return true;
+}
@@ -0,0 +1,77 @@
+#ifndef _REGION_H
+#define _REGION_H
+
+#include "util.h"
+
+// Chunks per region file along each axis
+#define REGION_SIZE 32
+#define REGION_CHUNK_COUNT (REGION_SIZE * REGION_SIZE)
+#define MAX_OPEN_REGIONS 64
+
+// Region file layout:
+//   header: REGION_CHUNK_COUNT entries, indexed by MOD(x, REGION_SIZE) + MOD(z, REGION_SIZE) * REGION_SIZE
+//   payloads: serialized chunks, see serialize_sections(), appended on every write
+//   replaced payloads stay in the file until it is compacted the next time it is opened
+typedef struct {
+    // Byte offset of the payload, 0 if the chunk was never saved
+    u32 offset;
+    u32 size;
+} RegionEntry;
+
+#define REGION_HEADER_SIZE (REGION_CHUNK_COUNT * sizeof(RegionEntry))
+
+typedef struct {
+    ivec2s pos;
+    // -1 if the file does not exist yet, it is created by the first write
+    int fd;
+    // Where the next payload is appended
+    u64 end;
+    // Read only mapping of the file, remapped when the file outgrows it
+    const u8 *map;
+    u64 map_size;
+    u64 last_used;
+    RegionEntry entries[REGION_CHUNK_COUNT];
+} Region;
+
+// Mapping that was replaced or closed while data handed out from it may still be read
+typedef struct {
+    const u8 *map;
+    u64 size;
+    // Epoch it was retired in
+    u64 epoch;
+} RetiredMapping;
+
+// Open region files with their headers in memory, the least recently used one is closed when full
+typedef struct {
+    const char *dir;
+    Region *regions[MAX_OPEN_REGIONS];
+    u32 region_count;
+    u64 clock;
+
+    // Set by the caller, mappings retired now stay mapped until region_unmap_retired() reaches this epoch
+    u64 epoch;
+    RetiredMapping *retired;
+    u32 retired_count;
+    u32 retired_allocated;
+
+    // Holds payloads read with pread() when a region can not be mapped
+    u8 *read_buffer;
+    u32 read_buffer_size;
+} RegionStore;
+
+// Position of the region holding the chunk
+ivec2s region_of_chunk(ivec2s chunk_pos);
+
+void init_region_store(RegionStore *store, const char *dir);
+void destroy_region_store(RegionStore *store);
+
+// Payload of a saved chunk, NULL if it was never saved
+// If mapped is set it points into the mapped file and stays valid until the mapping is retired and unmapped,
+// otherwise it points into a buffer reused by the next call on the store
+const u8 *region_chunk_data(RegionStore *store, ivec2s pos, u32 *size, bool *mapped);
+// Appends to the file, then points the header at the new payload
+bool region_write_chunk(RegionStore *store, ivec2s pos, const u8 *data, u32 size);
+// Unmaps the mappings retired at or before the given epoch
+void region_unmap_retired(RegionStore *store, u64 epoch);
+
+#endif
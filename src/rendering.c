@@ -2,21 +2,41 @@
 
 #include <stb_image/stb_image.h>
 #include "thread_pool.h"
-
-#include "player.h"
+#include "config.h"
+#include "memory.h"
 
 #include <xmmintrin.h>
+#include <assert.h>
 
 static RenderState render_state;
 
-// Number of threads to use for rendering, therefore number of sections the screen is split into
-#define RENDER_THREAD_COUNT 16
-
 RenderSection render_sections[RENDER_THREAD_COUNT];
 ThreadPool thread_pool;
 
+static RenderStats render_stats;
+static u64 raster_start;
+
+// Transient per-frame data (tasks, ...), reset in present()
+#define FRAME_ARENA_BLOCK_SIZE (64 * 1024)
+#define SECTION_ARENA_BLOCK_SIZE (4 * sizeof(TriangleBin))
+
+static Arena frame_arena;
+static u64 last_heap_allocations;
+
+#ifdef DEBUG_FRAME_ALLOCATIONS
+// Tracked allocations when begin_frame() was called
+static u64 frame_start_allocations;
+
+// Every tag the render path allocates with, world allocations also come from background workers mid-frame
+static u64 count_render_allocations() {
+    return get_memory_stats(MEMORY_TAG_RENDERING).allocations
+        + get_memory_stats(MEMORY_TAG_THREAD_POOL).allocations
+        + get_memory_stats(MEMORY_TAG_TEXTURE).allocations;
+}
+#endif
+
 #define SET_PIXEL(x, y, color) \
-        render_state.pixels[((y) * SCREEN_WIDTH) + (x)] = (color);
+        render_state.pixels[((y) * SCREEN_PITCH) + (x)] = (color);
 
 static i32 max(i32 a, i32 b, i32 c) {
     if(a >= b && a >= c) {
@@ -76,6 +96,14 @@ static bool sort_cw(Vertex *vertices) {
     return false;
 }
 
+static u64 count_heap_allocations() {
+    u64 count = frame_arena.heap_allocations;
+    for(u32 i = 0; i < RENDER_THREAD_COUNT; i++) {
+        count += render_sections[i].arena.heap_allocations;
+    }
+    return count;
+}
+
 RenderState *init_rendering(Window *window) {
     render_state.renderer = SDL_CreateRenderer(window->handle, NULL, SDL_RENDERER_PRESENTVSYNC);
 
@@ -94,31 +122,42 @@ RenderState *init_rendering(Window *window) {
 
     memset(render_state.depth_buffer, 0, sizeof(render_state.depth_buffer));
 
-    u32 section_width = floorf((f32) SCREEN_WIDTH / RENDER_THREAD_COUNT);
-    u32 x = 0;
+    // Sections are horizontal bands, since rows start on a cache line no two threads share one
+    u32 section_height = floorf((f32) SCREEN_HEIGHT / RENDER_THREAD_COUNT);
+    u32 y = 0;
     for(u32 i = 0; i < RENDER_THREAD_COUNT; i++) {
         RenderSection section = { 0 };
         if(i < RENDER_THREAD_COUNT - 1) {
             section.bounds = (ivec4s) {
-                x,
                 0,
-                x + section_width - 1,
-                SCREEN_HEIGHT - 1
+                y,
+                SCREEN_WIDTH - 1,
+                y + section_height - 1
             };
         } else {
             section.bounds = (ivec4s) {
-                x,
                 0,
+                y,
                 SCREEN_WIDTH - 1,
                 SCREEN_HEIGHT - 1
             };
         }
-        x += section_width;
+        y += section_height;
 
         render_sections[i] = section;
+        init_arena(&render_sections[i].arena, SECTION_ARENA_BLOCK_SIZE, MEMORY_TAG_RENDERING);
     }
 
-    init_thread_pool(&thread_pool, RENDER_THREAD_COUNT);
+    init_arena(&frame_arena, FRAME_ARENA_BLOCK_SIZE, MEMORY_TAG_RENDERING);
+    last_heap_allocations = count_heap_allocations();
+
+    init_thread_pool(
+        &thread_pool,
+        RENDER_THREAD_COUNT,
+        &config.render_affinity,
+        config.background_threads,
+        &config.background_affinity);
+    thread_pool.frame_arena = &frame_arena;
 
     return &render_state;
 }
@@ -127,6 +166,11 @@ void cleanup_rendering() {
     thread_pool.active = false;
     destroy_thread_pool(&thread_pool);
 
+    for(u32 i = 0; i < RENDER_THREAD_COUNT; i++) {
+        destroy_arena(&render_sections[i].arena);
+    }
+    destroy_arena(&frame_arena);
+
     SDL_DestroyTexture(render_state.texture);
     SDL_DestroyRenderer(render_state.renderer);
 }
@@ -138,11 +182,15 @@ void set_clear_color(u8 r, u8 g, u8 b, u8 a) {
 }
 
 static void draw_render_section(RenderSection *section) {
-    for(u32 i = 0; i < section->triangle_list.count; i++) {
-        draw_triangle_raw(&section->triangle_list.parts[i], section->bounds, section->triangle_list.parts[i].texture);
+    u64 start = ns_now();
+
+    for(TriangleBin *bin = section->triangle_list.first; bin; bin = bin->next) {
+        for(u32 i = 0; i < bin->count; i++) {
+            draw_triangle_raw(&bin->parts[i], section->bounds, bin->parts[i].texture);
+        }
     }
 
-    section->triangle_list.count = 0;
+    section->raster_ns = ns_now() - start;
 }
 
 static void draw_render_section_thread_func(void *arg) {
@@ -150,17 +198,65 @@ static void draw_render_section_thread_func(void *arg) {
     draw_render_section(section);
 }
 
+// Only call once every frame task is done
+static void reset_frame_arenas() {
+    u64 heap_allocations = count_heap_allocations();
+    u64 frame_allocations = heap_allocations - last_heap_allocations;
+    last_heap_allocations = heap_allocations;
+    render_stats.heap_allocations += frame_allocations;
+
+    // The arenas may only grow when a section gets more triangles than it ever had
+    bool new_peak = false;
+    for(u32 i = 0; i < RENDER_THREAD_COUNT; i++) {
+        RenderSection *section = &render_sections[i];
+        if(section->triangle_list.count > section->triangle_list.peak_count) {
+            section->triangle_list.peak_count = section->triangle_list.count;
+            new_peak = true;
+        }
+
+        section->triangle_list.first = NULL;
+        section->triangle_list.last = NULL;
+        section->triangle_list.count = 0;
+        arena_reset(&section->arena);
+    }
+    arena_reset(&frame_arena);
+
+#ifdef DEBUG_FRAME_ALLOCATIONS
+    // Arena growth is a tracked allocation too
+    u64 render_allocations = count_render_allocations() - frame_start_allocations;
+    if(!new_peak && render_allocations != 0) {
+        fprintf(stderr, "Steady state frame did %lu heap allocations\n", render_allocations);
+        assert(render_allocations == 0);
+    }
+#else
+    (void) new_peak;
+#endif
+}
+
+void begin_frame() {
+#ifdef DEBUG_FRAME_ALLOCATIONS
+    frame_start_allocations = count_render_allocations();
+#endif
+}
+
 void present() {
     void *px;
     i32 pitch;
     SDL_LockTexture(render_state.texture, NULL, &px, &pitch);
-    memcpy(px, render_state.pixels, sizeof(render_state.pixels));
+    for(u32 y = 0; y < SCREEN_HEIGHT; y++) {
+        memcpy(
+            (u8*) px + y * pitch,
+            &render_state.pixels[y * SCREEN_PITCH],
+            SCREEN_WIDTH * sizeof(u32));
+    }
     SDL_UnlockTexture(render_state.texture);
 
     SDL_SetRenderTarget(render_state.renderer, NULL);
     SDL_SetRenderDrawColor(render_state.renderer, 0, 0, 0, 0xFF);
     SDL_SetRenderDrawBlendMode(render_state.renderer, SDL_BLENDMODE_NONE);
 
+    reset_frame_arenas();
+
     memset32(render_state.pixels, 0xFFFFAE00, sizeof(render_state.pixels));
     memset(render_state.depth_buffer, 0, sizeof(render_state.depth_buffer));
 
@@ -178,23 +274,31 @@ Texture load_texture(const char *path) {
 
     data = stbi_load(path, &width, &height, &channels, 4);
 
+    Texture texture;
+    texture.data = NULL;
+
     if(!data) {
         fprintf(stderr, "Failed to load image from path %s\n", path);
+    } else {
+        // Copied so texture memory shows up in the memory stats
+        u64 size = (u64) width * height * 4;
+        texture.data = tracked_malloc(MEMORY_TAG_TEXTURE, size);
+        memcpy(texture.data, data, size);
+        stbi_image_free(data);
     }
 
-    Texture texture;
     texture.width = width;
     texture.height = height;
-    texture.data = data;
     texture.pixel_size = (vec2s) {
         1.0f / texture.width,
         1.0f / texture.height
     };
+    texture.tile_size = (vec2s) {1.0f, 1.0f};
     return texture;
 }
 
 void destroy_texture(Texture *texture) {
-    stbi_image_free(texture->data);
+    tracked_free(texture->data);
 }
 
 void draw_line(vec3s v1, vec3s v2, u32 color) {
@@ -270,82 +374,68 @@ static bool is_vertex_visible(const Vertex *vertex) {
     return fabsf(vertex->pos.z) <= vertex->w;
 }
 
-// Returns true if FULLY visible
-static bool is_triangle_visible(Vertex *vertices) {
-    bool visible[3] = {false};
+// Transforms a vertex from model space to NDC, false if it is outside the near or far plane
+static bool project_vertex(Vertex *vertex, const mat4s *m) {
+    vec4s v = glms_mat4_mulv(*m, (vec4s) {vertex->pos.x, vertex->pos.y, vertex->pos.z, vertex->w});
+    vertex->pos = (vec3s) {v.x, v.y, v.z};
+    vertex->w = v.w;
 
-    for(u32 i = 0; i < 3; i++) {
-        Vertex *vertex = &vertices[i];
-        if(is_vertex_visible(vertex)) {
-            visible[i] = true;
-        }
-    }
+    bool visible = is_vertex_visible(vertex);
+    // Keeps depth between 0 and w
+    vertex->pos.z = SDL_clamp(vertex->pos.z, 0.0f, fabsf(vertex->w));
 
-    return visible[0] && visible[1] && visible[2];
+    vertex->pos.x = v.w == 0.0f ? 0.0f : vertex->pos.x / v.w;
+    vertex->pos.y = v.w == 0.0f ? 0.0f : vertex->pos.y / v.w;
+    vertex->pos.z = v.w == 0.0f ? 0.0f : vertex->pos.z / v.w;
+    return visible;
 }
 
-static void clip_triangle(Vertex *vertices) {
-    // TODO: actually make this a real algorithm
-
-    for(u32 i = 0; i < 3; i++) {
-        Vertex *vertex = &vertices[i];
-        vertex->pos.z = SDL_clamp(vertex->pos.z, 0.0f, fabsf(vertex->w));
-    }
-}
+// Triangles of a quad, same winding as the corners
+static const u8 quad_triangles[2][3] = {{0, 1, 2}, {2, 3, 0}};
 
-void draw_triangles(
+void draw_packed_quads(
     u32 count,
-    const Vertex *vertices,
+    const PackedVertex *vertices,
     const Texture *texture,
     mat4s proj,
     mat4s view,
     mat4s model) {
-    Vertex local_vertices[3];
     mat4s m = glms_mat4_mul(view, model);
     m = glms_mat4_mul(proj, m);
 
-    for(u32 i = 0; i < count; i++) {
-        memcpy(local_vertices, &vertices[i * 3], sizeof(local_vertices));
-        // Hack to save on performance
-        if(local_vertices[0].pos.y <= 0.0f
-            && local_vertices[1].pos.y <= 0.0f
-            && local_vertices[2].pos.y <= 0.0f
-            && player.camera.pos.y >= 0.0f) {
-            continue;
-        }
+    // Tiles are numbered row by row, float math keeps integer divisions out of the loop
+    vec2s tile_size = texture->tile_size;
+    f32 tiles_per_row = roundf(1.0f / tile_size.x);
 
-        for(u32 j = 0; j < 3; j++) {
-            vec4s v =
-                glms_mat4_mulv(
-                    m,
-                    (vec4s) {
-                        local_vertices[j].pos.x,
-                        local_vertices[j].pos.y,
-                        local_vertices[j].pos.z,
-                        local_vertices[j].w});
-
-            local_vertices[j].pos.x = v.x;
-            local_vertices[j].pos.y = v.y;
-            local_vertices[j].pos.z = v.z;
-            local_vertices[j].w = v.w;
+    for(u32 i = 0; i < count; i++) {
+        const PackedVertex *quad = &vertices[i * 4];
+
+        // Every corner is transformed once for both triangles
+        Vertex corners[4];
+        bool visible[4];
+        for(u32 j = 0; j < 4; j++) {
+            const PackedVertex *packed = &quad[j];
+            f32 row = floorf((packed->tile + 0.5f) * tile_size.x);
+            f32 column = packed->tile - row * tiles_per_row;
+            corners[j] = (Vertex) {
+                (vec3s) {packed->x, packed->y, packed->z},
+                1.0f,
+                (vec2s) {(column + packed->u) * tile_size.x, (row + packed->v) * tile_size.y},
+                packed->light * (1.0f / 255.0f)
+            };
+            visible[j] = project_vertex(&corners[j], &m);
         }
 
-        if(is_triangle_visible(local_vertices)) {
-            clip_triangle(local_vertices);
-
-            for(u32 j = 0; j < 3; j++) {
-                vec4s v = (vec4s) {
-                    local_vertices[j].pos.x,
-                    local_vertices[j].pos.y,
-                    local_vertices[j].pos.z,
-                    local_vertices[j].w};
-                local_vertices[j].pos.x = v.w == 0.0f ? 0.0f : v.x / v.w;
-                local_vertices[j].pos.y = v.w == 0.0f ? 0.0f : v.y / v.w;
-                local_vertices[j].pos.z = v.w == 0.0f ? 0.0f : v.z / v.w;
+        for(u32 j = 0; j < 2; j++) {
+            const u8 *indices = quad_triangles[j];
+            // Only fully visible triangles are drawn
+            if(!visible[indices[0]] || !visible[indices[1]] || !visible[indices[2]]) {
+                continue;
             }
 
-            sort_cw(local_vertices);
-            draw_triangle(local_vertices, texture);
+            Vertex triangle[3] = {corners[indices[0]], corners[indices[1]], corners[indices[2]]};
+            sort_cw(triangle);
+            draw_triangle(triangle, texture);
         }
     }
 }
@@ -362,20 +452,24 @@ static RenderSection *get_render_section(ivec2s coords) {
 }
 
 static void push_triangle_to_render_section(RenderSection *section, TrianglePart *triangle) {
-    if(!section->triangle_list.parts) {
-        section->triangle_list.parts = malloc(1024 * sizeof(TrianglePart));
-        section->triangle_list.allocated_size = 1024;
-    }
+    TriangleBin *bin = section->triangle_list.last;
 
-    if(section->triangle_list.count >= section->triangle_list.allocated_size) {
-        section->triangle_list.parts =
-            realloc(
-                section->triangle_list.parts,
-                2 * section->triangle_list.allocated_size * sizeof(TrianglePart));
-        section->triangle_list.allocated_size *= 2;
+    if(!bin || bin->count >= TRIANGLE_BIN_SIZE) {
+        TriangleBin *new_bin = arena_alloc_aligned(&section->arena, sizeof(TriangleBin), CACHE_LINE_SIZE);
+        new_bin->next = NULL;
+        new_bin->count = 0;
+
+        if(bin) {
+            bin->next = new_bin;
+        } else {
+            section->triangle_list.first = new_bin;
+        }
+        section->triangle_list.last = new_bin;
+        bin = new_bin;
     }
 
-    section->triangle_list.parts[section->triangle_list.count] = *triangle;
+    bin->parts[bin->count] = *triangle;
+    bin->count++;
     section->triangle_list.count++;
 }
 
@@ -423,15 +517,15 @@ void draw_triangle(const Vertex *vertices, const Texture *texture) {
         return;
     }
 
-    RenderSection *left_render_section = get_render_section((ivec2s) {min_x, 0});
-    RenderSection *right_render_section = get_render_section((ivec2s) {max_x, 0});
+    RenderSection *top_render_section = get_render_section((ivec2s) {0, min_y});
+    RenderSection *bottom_render_section = get_render_section((ivec2s) {0, max_y});
 
     // Triangle must be outside of screen for some reason, this shouldn't happen though
-    if(!left_render_section || !right_render_section) {
+    if(!top_render_section || !bottom_render_section) {
         return;
     }
 
-    if(left_render_section == right_render_section) {
+    if(top_render_section == bottom_render_section) {
         // Triangle is in the same section
         TrianglePart triangle_part;
         memcpy(triangle_part.vertices, raw_vertices, sizeof(raw_vertices));
@@ -440,19 +534,19 @@ void draw_triangle(const Vertex *vertices, const Texture *texture) {
         triangle_part.min_y = min_y;
         triangle_part.max_y = max_y;
         triangle_part.texture = texture;
-        push_triangle_to_render_section(left_render_section, &triangle_part);
+        push_triangle_to_render_section(top_render_section, &triangle_part);
     } else {
         // Triangle is split across multiple sections
         for(u32 i = 0; i < RENDER_THREAD_COUNT; i++) {
             RenderSection *section = &render_sections[i];
-            bool is_in_section = max_x >= section->bounds.x && min_x <= section->bounds.z;
+            bool is_in_section = max_y >= section->bounds.y && min_y <= section->bounds.w;
             if(is_in_section) {
                 TrianglePart triangle_part;
                 memcpy(triangle_part.vertices, raw_vertices, sizeof(raw_vertices));
-                triangle_part.min_x = section->bounds.x;
-                triangle_part.max_x = max_x >= section->bounds.z ? section->bounds.z : max_x;
-                triangle_part.min_y = min_y;
-                triangle_part.max_y = max_y;
+                triangle_part.min_x = min_x;
+                triangle_part.max_x = max_x;
+                triangle_part.min_y = min_y >= section->bounds.y ? min_y : section->bounds.y;
+                triangle_part.max_y = max_y >= section->bounds.w ? section->bounds.w : max_y;
                 triangle_part.texture = texture;
                 
                 push_triangle_to_render_section(section, &triangle_part);
@@ -480,6 +574,9 @@ void draw_triangle_raw(const TrianglePart *part, ivec4s section_bounds, const Te
     const f32 max_uvx = SDL_max(uv1.x, SDL_max(uv2.x, uv3.x)) - texture->pixel_size.x;
     const f32 max_uvy = SDL_max(uv1.y, SDL_max(uv2.y, uv3.y)) - texture->pixel_size.y;
 
+    const vec2s tile_size = texture->tile_size;
+    const vec2s inverse_tile_size = (vec2s) {1.0f / tile_size.x, 1.0f / tile_size.y};
+
     const __m128 v_uv_x = _mm_setr_ps(uv1.x, uv3.x, uv2.x, 0.0f);
     const __m128 v_uv_y = _mm_setr_ps(uv1.y, uv3.y, uv2.y, 0.0f);
 
@@ -545,6 +642,13 @@ void draw_triangle_raw(const TrianglePart *part, ivec4s section_bounds, const Te
     __m128 v_dbc_row = _mm_setr_ps(du_row, dv_row, dw_row, 0.0f);
     __m128 v_dbc = _mm_setr_ps(du, dv, dw, 0.0f);
 
+    // Barycentrics are set up, from here on the edge functions are only used for coverage
+    // Pixels up to half a pixel outside an edge are covered too
+    // Vertices snap to whole pixels, so edges that meet in the middle of a longer edge would leave cracks
+    e_row1 += SDL_max(abs(x1 - x3), abs(y1 - y3)) / 2;
+    e_row2 += SDL_max(abs(x3 - x2), abs(y3 - y2)) / 2;
+    e_row3 += SDL_max(abs(x2 - x1), abs(y2 - y1)) / 2;
+
     // Since we are not interpolating brightness we can just take it from the first vertex
     const f32 brightness = part->vertices[0].brightness;
     const u32 fp_brightness = (1 << 10) * brightness;
@@ -555,7 +659,7 @@ void draw_triangle_raw(const TrianglePart *part, ivec4s section_bounds, const Te
         i32 e3 = e_row3;
 
         __m128 v_raw_bc = v_raw_bc_row;
-        i32 *depth_row = &render_state.depth_buffer[y * SCREEN_WIDTH];
+        i32 *depth_row = &render_state.depth_buffer[y * SCREEN_PITCH];
         for(i32 x = min_x; x <= max_x; x++) {
             if((e1 | e2 | e3) >= 0) {
                 __m128 v_bc = v_raw_bc;
@@ -576,6 +680,12 @@ void draw_triangle_raw(const TrianglePart *part, ivec4s section_bounds, const Te
                     tex_coords.x = SDL_clamp(tex_coords.x, min_uvx, max_uvx);
                     tex_coords.y = SDL_clamp(tex_coords.y, min_uvy, max_uvy);
 
+                    // Merged faces repeat their tile, the minimum UV is the corner of the first tile
+                    f32 tile_x = tex_coords.x - min_uvx;
+                    f32 tile_y = tex_coords.y - min_uvy;
+                    tex_coords.x = min_uvx + tile_x - floorf(tile_x * inverse_tile_size.x) * tile_size.x;
+                    tex_coords.y = min_uvy + tile_y - floorf(tile_y * inverse_tile_size.y) * tile_size.y;
+
                     u32 index_width = (tex_coords.x * (texture->width));
                     index_width = SDL_clamp(index_width, 0, texture->width);
                     u32 index_height = tex_coords.y * texture->height;
@@ -621,6 +731,8 @@ void draw_triangle_raw(const TrianglePart *part, ivec4s section_bounds, const Te
 }
 
 void draw_screen() {
+    raster_start = ns_now();
+
     pthread_mutex_lock(&thread_pool.mutex);
     for(u32 i = 0; i < RENDER_THREAD_COUNT; i++) {
         push_task(&thread_pool, draw_render_section_thread_func, &render_sections[i]);
@@ -629,5 +741,30 @@ void draw_screen() {
 }
 
 void render_wait() {
-    thread_pool_wait(&thread_pool);
+    thread_pool_wait_priority(&thread_pool, TASK_PRIORITY_FRAME);
+
+    render_stats.frames++;
+    render_stats.raster_ns += ns_now() - raster_start;
+
+    u64 slowest = 0;
+    for(u32 i = 0; i < RENDER_THREAD_COUNT; i++) {
+        u64 ns = render_sections[i].raster_ns;
+        render_stats.section_ns += ns;
+        if(ns > slowest) {
+            slowest = ns;
+        }
+    }
+    render_stats.slowest_section_ns += slowest;
+}
+
+RenderStats get_render_stats() {
+    return render_stats;
+}
+
+void reset_render_stats() {
+    render_stats = (RenderStats) {0};
+}
+
+ThreadPool *get_thread_pool() {
+    return &thread_pool;
 }
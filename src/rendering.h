@@ -6,18 +6,25 @@
 
 #include "util.h"
 #include "window.h"
+#include "thread_pool.h"
+#include "arena.h"
 
 #define SCREEN_WIDTH 427
 #define SCREEN_HEIGHT 240
+// Row length of the framebuffers in pixels, padded so every row starts on a cache line
+#define SCREEN_PITCH ALIGN_UP(SCREEN_WIDTH, CACHE_LINE_SIZE / sizeof(u32))
 
 #define DEPTH_PRECISION (1 << 16)
 
+// Number of threads to use for rendering, therefore number of sections the screen is split into
+#define RENDER_THREAD_COUNT 16
+
 typedef struct {
     SDL_Surface *surface;
     SDL_Renderer *renderer;
     SDL_Texture *texture;
-    u32 pixels[SCREEN_WIDTH * SCREEN_HEIGHT];
-    i32 depth_buffer[SCREEN_WIDTH * SCREEN_HEIGHT];
+    _Alignas(CACHE_LINE_SIZE) u32 pixels[SCREEN_PITCH * SCREEN_HEIGHT];
+    _Alignas(CACHE_LINE_SIZE) i32 depth_buffer[SCREEN_PITCH * SCREEN_HEIGHT];
 } RenderState;
 
 typedef struct {
@@ -27,6 +34,8 @@ typedef struct {
 
     // Pixel size in UV coordinates
     vec2s pixel_size;
+    // Size of a repeating tile in UV coordinates, UVs past the tile a triangle starts in wrap around
+    vec2s tile_size;
 } Texture;
 
 typedef struct {
@@ -36,6 +45,19 @@ typedef struct {
     f32 brightness;
 } Vertex;
 
+// Compact vertex for meshes on a grid, 8 bytes instead of 28, decoded by draw_packed_quads()
+typedef struct {
+    // Position in model space
+    u8 x, y, z;
+    // Brightness, 255 is full
+    u8 light;
+    // Texture tile, numbered row by row
+    u8 tile;
+    // Texture coordinates in tiles from the tile's corner, past 1 the tile repeats
+    u8 u, v;
+    u8 padding;
+} PackedVertex;
+
 typedef struct {
     ivec3s pos;
     f32 w; // For perspective correct interpolation
@@ -50,25 +72,57 @@ typedef struct {
     const Texture *texture;
 } TrianglePart;
 
-// Section of the screen to render
+#define TRIANGLE_BIN_SIZE 512
+
+// Fixed size piece of a section's triangle list, allocated from the section's arena
+typedef struct TriangleBin {
+    struct TriangleBin *next;
+    u32 count;
+    TrianglePart parts[TRIANGLE_BIN_SIZE];
+} TriangleBin;
+
+// Section of the screen to render, each one is owned by a single render thread
+// Aligned to a cache line so threads never write to the same line
 typedef struct {
     // x, y, x + width, y + width
-    ivec4s bounds;
+    _Alignas(CACHE_LINE_SIZE) ivec4s bounds;
+
+    // Time spent drawing the section last frame
+    u64 raster_ns;
 
-    // Arraylist of triangle parts
+    // Sub-arena for the section's bins, reset every frame
+    Arena arena;
+
+    // Linked list of bins
     struct {
-        TrianglePart *parts;
+        TriangleBin *first;
+        TriangleBin *last;
         u32 count;
-        u32 allocated_size;
+        // Highest count so far, the arena has grown to fit it
+        u32 peak_count;
     } triangle_list;
 } RenderSection;
 
+typedef struct {
+    u64 frames;
+    // Wall time from draw_screen() until all sections are done
+    u64 raster_ns;
+    // Sum of the time spent in every section
+    u64 section_ns;
+    // Sum of the slowest section's time per frame
+    u64 slowest_section_ns;
+    // Heap allocations made by the frame arenas, zero once they have grown to fit the scene
+    u64 heap_allocations;
+} RenderStats;
+
 RenderState *init_rendering(Window *window);
 
 void cleanup_rendering();
 
 void set_clear_color(u8 r, u8 g, u8 b, u8 a);
 
+// Marks the start of the render path, with DEBUG_FRAME_ALLOCATIONS present() asserts nothing was allocated since
+void begin_frame();
 void present();
 
 Texture load_texture(const char *path);
@@ -77,9 +131,11 @@ void destroy_texture(Texture *texture);
 void draw_line(vec3s v1, vec3s v2, u32 color);
 void draw_line_raw(u32 x1, u32 y1, u32 x2, u32 y2, u32 color);
 
-void draw_triangles(
+// Every 4 vertices are a flat quad, drawn as the triangles 0, 1, 2 and 2, 3, 0
+// texture->tile_size gives the tile layout
+void draw_packed_quads(
     u32 count,
-    const Vertex *vertices,
+    const PackedVertex *vertices,
     const Texture *texture,
     mat4s proj,
     mat4s view,
@@ -88,6 +144,13 @@ void draw_triangle(const Vertex *vertices, const Texture *texture);
 void draw_triangle_raw(const TrianglePart *part, ivec4s section_bounds, const Texture *texture);
 
 void draw_screen();
+// Waits for the frame's raster tasks, background tasks keep running
 void render_wait();
 
+RenderStats get_render_stats();
+void reset_render_stats();
+
+// Shared by rendering (frame tasks) and the world (background tasks)
+ThreadPool *get_thread_pool();
+
 #endif
\ No newline at end of file
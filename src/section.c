@@ -0,0 +1,321 @@
+#include "section.h"
+#include "world.h"
+#include "memory.h"
+
+#include <string.h>
+
+// Index buffers for 1, 2, 4 and 8 bits per block
+#define BUFFER_CLASS_COUNT 4
+
+// Index buffers of cleared sections, per size, reused before allocating new ones
+static struct {
+    u8 **buffers;
+    u32 count;
+    u32 allocated;
+} free_buffers[BUFFER_CLASS_COUNT];
+
+extern inline u8 section_get(const ChunkSection *section, u32 index);
+
+static u32 buffer_class(u8 bits) {
+    switch(bits) {
+        case 1: return 0;
+        case 2: return 1;
+        case 4: return 2;
+        default: return 3;
+    }
+}
+
+static u32 buffer_size(u8 bits) {
+    return SECTION_VOLUME * bits / 8;
+}
+
+static u8 *alloc_indices(u8 bits) {
+    u32 class = buffer_class(bits);
+    if(free_buffers[class].count > 0) {
+        free_buffers[class].count--;
+        return free_buffers[class].buffers[free_buffers[class].count];
+    }
+    return tracked_malloc(MEMORY_TAG_WORLD, buffer_size(bits));
+}
+
+static void free_indices(u8 *buffer, u8 bits) {
+    u32 class = buffer_class(bits);
+    if(!free_buffers[class].buffers) {
+        free_buffers[class].buffers = tracked_malloc(MEMORY_TAG_WORLD, 32 * sizeof(u8*));
+        free_buffers[class].allocated = 32;
+    }
+
+    if(free_buffers[class].count >= free_buffers[class].allocated) {
+        free_buffers[class].buffers = tracked_realloc(
+            MEMORY_TAG_WORLD,
+            free_buffers[class].buffers,
+            2 * free_buffers[class].allocated * sizeof(u8*));
+        free_buffers[class].allocated *= 2;
+    }
+
+    free_buffers[class].buffers[free_buffers[class].count] = buffer;
+    free_buffers[class].count++;
+}
+
+void init_section(ChunkSection *section) {
+    *section = (ChunkSection) {0};
+    section->palette[0] = BLOCK_AIR;
+    section->palette_size = 1;
+}
+
+void clear_section(ChunkSection *section) {
+    if(section->indices) {
+        free_indices(section->indices, section->bits);
+    }
+    init_section(section);
+}
+
+static void set_index(u8 *indices, u8 bits, u32 index, u8 value) {
+    u32 bit = index * bits;
+    u8 mask = ((1 << bits) - 1) << (bit & 7);
+    indices[bit >> 3] = (indices[bit >> 3] & ~mask) | (value << (bit & 7));
+}
+
+// Re-encodes every block with the new palette and width, palette must hold every type present
+static void repack(ChunkSection *section, const u8 *palette, u8 palette_size, u8 bits) {
+    u8 *indices = NULL;
+    if(bits > 0) {
+        indices = alloc_indices(bits);
+        memset(indices, 0, buffer_size(bits));
+
+        // Palettes are small, map each type to its new index once
+        u8 remap[MAX_BLOCK_ID + 1];
+        for(u32 i = 0; i < palette_size; i++) {
+            remap[palette[i]] = i;
+        }
+
+        for(u32 i = 0; i < SECTION_VOLUME; i++) {
+            u8 type = section_get(section, i);
+            set_index(indices, bits, i, bits == 8 ? type : remap[type]);
+        }
+    }
+
+    if(section->indices) {
+        free_indices(section->indices, section->bits);
+    }
+
+    section->indices = indices;
+    section->bits = bits;
+    section->palette_size = bits == 8 ? 0 : palette_size;
+    if(bits < 8) {
+        memcpy(section->palette, palette, palette_size);
+    }
+}
+
+// Smallest width that fits palette_size entries
+static u8 bits_for_palette(u32 palette_size) {
+    if(palette_size <= 1) {
+        return 0;
+    }
+    if(palette_size <= 2) {
+        return 1;
+    }
+    if(palette_size <= 4) {
+        return 2;
+    }
+    if(palette_size <= SECTION_PALETTE_SIZE) {
+        return 4;
+    }
+    return 8;
+}
+
+// Returns the palette index of type, adding it and widening the indices if needed
+static u8 palette_index(ChunkSection *section, u8 type) {
+    if(section->bits == 8) {
+        return type;
+    }
+
+    // A single value section always has exactly palette[0]
+    u8 palette_size = section->bits == 0 ? 1 : section->palette_size;
+    for(u32 i = 0; i < palette_size; i++) {
+        if(section->palette[i] == type) {
+            return i;
+        }
+    }
+
+    u8 bits = bits_for_palette(palette_size + 1);
+    if(bits != section->bits) {
+        u8 palette[SECTION_PALETTE_SIZE];
+        memcpy(palette, section->palette, palette_size);
+        repack(section, palette, palette_size, bits);
+    }
+
+    if(bits == 8) {
+        return type;
+    }
+
+    section->palette[palette_size] = type;
+    section->palette_size = palette_size + 1;
+    return palette_size;
+}
+
+void section_set(ChunkSection *section, u32 index, u8 type) {
+    u8 old_type = section_get(section, index);
+    if(old_type == type) {
+        return;
+    }
+
+    section->non_air_count += (type != BLOCK_AIR) - (old_type != BLOCK_AIR);
+    section->opaque_count += !blocks[type].transparent - !blocks[old_type].transparent;
+
+    if(section->non_air_count == 0) {
+        clear_section(section);
+        return;
+    }
+
+    u8 value = palette_index(section, type);
+    set_index(section->indices, section->bits, index, value);
+}
+
+void compact_section(ChunkSection *section) {
+    if(section->bits == 0) {
+        return;
+    }
+
+    bool present[MAX_BLOCK_ID + 1] = {0};
+    u8 palette[MAX_BLOCK_ID + 1];
+    u32 palette_size = 0;
+
+    for(u32 i = 0; i < SECTION_VOLUME; i++) {
+        u8 type = section_get(section, i);
+        if(!present[type]) {
+            present[type] = true;
+            palette[palette_size] = type;
+            palette_size++;
+        }
+    }
+
+    u8 bits = bits_for_palette(palette_size);
+    if(bits == 0) {
+        free_indices(section->indices, section->bits);
+        section->indices = NULL;
+        section->bits = 0;
+        section->palette[0] = palette[0];
+        section->palette_size = 1;
+    } else if(bits != section->bits || (bits < 8 && palette_size != section->palette_size)) {
+        repack(section, palette, palette_size, bits);
+    }
+}
+
+void section_unpack(const ChunkSection *section, u8 *dest, u32 row_stride, u32 layer_stride) {
+    u8 mask = (1 << section->bits) - 1;
+
+    for(u32 y = 0; y < SECTION_SIZE; y++) {
+        for(u32 z = 0; z < SECTION_SIZE; z++) {
+            u8 *row = dest + y * layer_stride + z * row_stride;
+            u32 index = z * SECTION_SIZE + y * SECTION_SIZE * SECTION_SIZE;
+
+            if(section->bits == 0) {
+                memset(row, section->palette[0], SECTION_SIZE);
+            } else if(section->bits == 8) {
+                memcpy(row, &section->indices[index], SECTION_SIZE);
+            } else {
+                // Rows start on a byte boundary at every width below 8
+                const u8 *packed = &section->indices[index * section->bits / 8];
+                for(u32 x = 0; x < SECTION_SIZE; x++) {
+                    u32 bit = x * section->bits;
+                    row[x] = section->palette[(packed[bit >> 3] >> (bit & 7)) & mask];
+                }
+            }
+        }
+    }
+}
+
+u32 section_index_bytes(const ChunkSection *section) {
+    return buffer_size(section->bits);
+}
+
+// Per section: bits, palette size, non-air count, opaque count, palette, then the compressed size and indices
+u32 serialize_sections(const ChunkSection *sections, u32 count, u8 *dest) {
+    u8 *out = dest;
+
+    for(u32 i = 0; i < count; i++) {
+        const ChunkSection *section = &sections[i];
+        u8 palette_size = section->bits == 0 ? 1 : section->palette_size;
+
+        *out++ = section->bits;
+        *out++ = palette_size;
+        memcpy(out, &section->non_air_count, sizeof(u16));
+        out += sizeof(u16);
+        memcpy(out, &section->opaque_count, sizeof(u16));
+        out += sizeof(u16);
+        memcpy(out, section->palette, palette_size);
+        out += palette_size;
+
+        if(section->bits > 0) {
+            // Size goes in front of the data
+            u8 *size_pos = out;
+            out += sizeof(u32);
+            u32 size = rle_compress(section->indices, buffer_size(section->bits), out);
+            memcpy(size_pos, &size, sizeof(u32));
+            out += size;
+        }
+    }
+
+    return out - dest;
+}
+
+bool deserialize_sections(const u8 *src, u32 size, ChunkSection *sections, u32 count) {
+    const u8 *in = src;
+    const u8 *end = src + size;
+
+    for(u32 i = 0; i < count; i++) {
+        ChunkSection *section = &sections[i];
+        if(end - in < 6) {
+            return false;
+        }
+
+        u8 bits = *in++;
+        u8 palette_size = *in++;
+        if((bits != 0 && bits != 1 && bits != 2 && bits != 4 && bits != 8)
+            || palette_size > SECTION_PALETTE_SIZE
+            || (bits < 8 && palette_size < 1)) {
+            return false;
+        }
+
+        memcpy(&section->non_air_count, in, sizeof(u16));
+        in += sizeof(u16);
+        memcpy(&section->opaque_count, in, sizeof(u16));
+        in += sizeof(u16);
+
+        if(end - in < (i64) palette_size) {
+            return false;
+        }
+        memcpy(section->palette, in, palette_size);
+        in += palette_size;
+        section->palette_size = palette_size;
+        section->bits = bits;
+
+        if(bits > 0) {
+            u32 data_size;
+            if(end - in < (i64) sizeof(u32)) {
+                return false;
+            }
+            memcpy(&data_size, in, sizeof(u32));
+            in += sizeof(u32);
+
+            section->indices = alloc_indices(bits);
+            if((u64) (end - in) < data_size || !rle_decompress(in, data_size, section->indices, buffer_size(bits))) {
+                return false;
+            }
+            in += data_size;
+        }
+    }
+
+    return true;
+}
+
+void destroy_section_buffers() {
+    for(u32 class = 0; class < BUFFER_CLASS_COUNT; class++) {
+        for(u32 i = 0; i < free_buffers[class].count; i++) {
+            tracked_free(free_buffers[class].buffers[i]);
+        }
+        tracked_free(free_buffers[class].buffers);
+        memset(&free_buffers[class], 0, sizeof(free_buffers[class]));
+    }
+}
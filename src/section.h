@@ -0,0 +1,62 @@
+#ifndef _SECTION_H
+#define _SECTION_H
+
+#include "util.h"
+#include "compress.h"
+
+// Sections are cubes of blocks, indexed x + z * SECTION_SIZE + y * SECTION_SIZE * SECTION_SIZE
+#define SECTION_SIZE 16
+#define SECTION_VOLUME (SECTION_SIZE * SECTION_SIZE * SECTION_SIZE)
+
+// Palettes are used up to 4 bits per block, at 8 bits the indices are the block types
+#define SECTION_PALETTE_SIZE 16
+
+typedef struct {
+    // Bit packed palette indices, NULL when bits is 0 and every block is palette[0]
+    u8 *indices;
+    u8 palette[SECTION_PALETTE_SIZE];
+    u8 palette_size;
+    // 0, 1, 2, 4 or 8
+    u8 bits;
+
+    u16 non_air_count;
+    // Non-transparent blocks, a section with SECTION_VOLUME of them is full
+    u16 opaque_count;
+} ChunkSection;
+
+// Makes an all air section
+void init_section(ChunkSection *section);
+// Gives the index buffer back to the free list and makes the section all air
+void clear_section(ChunkSection *section);
+
+inline u8 section_get(const ChunkSection *section, u32 index) {
+    if(section->bits == 0) {
+        return section->palette[0];
+    }
+
+    u32 bit = index * section->bits;
+    u8 value = (section->indices[bit >> 3] >> (bit & 7)) & ((1 << section->bits) - 1);
+    return section->bits == 8 ? value : section->palette[value];
+}
+
+// Grows the palette and index width as needed
+void section_set(ChunkSection *section, u32 index, u8 type);
+// Rebuilds the palette from the blocks actually present and picks the smallest index width
+void compact_section(ChunkSection *section);
+// Writes the type of every block, rows along x start row_stride bytes apart and layers along y layer_stride apart
+void section_unpack(const ChunkSection *section, u8 *dest, u32 row_stride, u32 layer_stride);
+// Bytes used by the section's index buffer
+u32 section_index_bytes(const ChunkSection *section);
+
+// Upper bound of serialize_sections() output for count sections
+#define SERIALIZED_SECTIONS_BOUND(count) ((count) * (16 + SECTION_PALETTE_SIZE + RLE_BOUND(SECTION_VOLUME)))
+
+// Writes the sections with their palettes and RLE compressed indices, returns the size
+u32 serialize_sections(const ChunkSection *sections, u32 count, u8 *dest);
+// sections must be empty, returns false if the data is corrupt, the sections then need clear_section()
+bool deserialize_sections(const u8 *src, u32 size, ChunkSection *sections, u32 count);
+
+// Frees the buffers kept on the free list
+void destroy_section_buffers();
+
+#endif
@@ -1,5 +1,6 @@
 // Implementation from https://nachtimwald.com/2019/04/12/thread-pool-in-c/
 #include "thread_pool.h"
+#include "memory.h"
 
 Task *create_task(task_func func, void *arg) {
     Task *task;
@@ -8,49 +9,77 @@ Task *create_task(task_func func, void *arg) {
         return NULL;
     }
 
-    task = malloc(sizeof(Task));
+    task = tracked_malloc(MEMORY_TAG_THREAD_POOL, sizeof(Task));
     task->func = func;
+    task->cancel_func = NULL;
     task->arg = arg;
+    task->owner = NULL;
+    task->priority = TASK_PRIORITY_FRAME;
+    task->arena_allocated = false;
     task->next = NULL;
     return task;
 }
 
 void destroy_task(Task *task) {
-    if(task) {
-        free(task);
+    if(task && !task->arena_allocated) {
+        tracked_free(task);
     }
 }
 
-static Task *next_task(ThreadPool *pool) {
+static void cancel_task(Task *task) {
+    if(task->cancel_func) {
+        task->cancel_func(task->arg);
+    }
+    destroy_task(task);
+}
+
+static bool has_task(const ThreadPool *pool, u32 priority_mask) {
+    for(u32 i = 0; i < TASK_PRIORITY_COUNT; i++) {
+        if((priority_mask & TASK_PRIORITY_BIT(i)) && pool->queues[i].last_task) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool is_idle(const ThreadPool *pool, TaskPriority priority) {
+    return !pool->queues[priority].last_task && pool->queues[priority].working_threads == 0;
+}
+
+static Task *next_task(ThreadPool *pool, TaskPriority priority) {
     Task *task;
 
     if(!pool) {
         return NULL;
     }
 
-    task = pool->last_task;
+    TaskQueue *queue = &pool->queues[priority];
+    task = queue->last_task;
     if(!task) {
         return NULL;
     }
 
     if(task->next == NULL) {
-        pool->last_task = NULL;
-        pool->first_task = NULL;
+        queue->last_task = NULL;
+        queue->first_task = NULL;
     } else {
-        pool->last_task = task->next;
+        queue->last_task = task->next;
     }
 
     return task;
 }
 
 static void *thread_func(void *arg) {
-    ThreadPool *pool = arg;
+    ThreadPoolWorker *worker = arg;
+    ThreadPool *pool = worker->pool;
     Task *task;
 
+    apply_thread_affinity(worker->affinity, worker->index);
+
     while(1) {
         pthread_mutex_lock(&pool->mutex);
 
-        while(!pool->last_task && pool->active) {
+        while(!has_task(pool, TASK_PRIORITY_BIT(worker->priority)) && pool->active) {
             pthread_cond_wait(&pool->task_cond, &pool->mutex);
         }
 
@@ -58,35 +87,50 @@ static void *thread_func(void *arg) {
             break;
         }
 
-        task = next_task(pool);
+        task = next_task(pool, worker->priority);
+        if(!task) {
+            pthread_mutex_unlock(&pool->mutex);
+            continue;
+        }
+
+        TaskPriority priority = task->priority;
         pool->working_threads++;
+        pool->queues[priority].working_threads++;
         pthread_mutex_unlock(&pool->mutex);
 
-        if(task) {
-            task->func(task->arg);
-            destroy_task(task);
-        }
+        task->func(task->arg);
+        destroy_task(task);
 
         pthread_mutex_lock(&pool->mutex);
         pool->working_threads--;
-        if(pool->active && pool->working_threads == 0 && !pool->last_task) {
-            pthread_cond_signal(&pool->working_cond);
+        pool->queues[priority].working_threads--;
+        if(pool->active && is_idle(pool, priority)) {
+            pthread_cond_broadcast(&pool->working_cond);
         }
         pthread_mutex_unlock(&pool->mutex);
     }
 
     pool->num_threads--;
-    pthread_cond_signal(&pool->working_cond);
+    pthread_cond_broadcast(&pool->working_cond);
     pthread_mutex_unlock(&pool->mutex);
     return NULL;
 }
 
-void init_thread_pool(ThreadPool *thread_pool, u32 num_threads) {
+void init_thread_pool(
+    ThreadPool *thread_pool,
+    u32 num_threads,
+    const ThreadAffinity *affinity,
+    u32 num_background_threads,
+    const ThreadAffinity *background_affinity) {
     if(num_threads < 1) {
         return;
     }
 
-    thread_pool->num_threads = num_threads;
+    thread_pool->affinity = affinity ? *affinity : (ThreadAffinity) {0};
+    thread_pool->background_affinity = background_affinity ? *background_affinity : (ThreadAffinity) {0};
+
+    u32 total_threads = num_threads + num_background_threads;
+    thread_pool->num_threads = total_threads;
     thread_pool->working_threads = 0;
     thread_pool->active = true;
 
@@ -94,12 +138,22 @@ void init_thread_pool(ThreadPool *thread_pool, u32 num_threads) {
     pthread_cond_init(&thread_pool->task_cond, NULL);
     pthread_cond_init(&thread_pool->working_cond, NULL);
 
-    thread_pool->last_task = NULL;
-    thread_pool->first_task = NULL;
-
-    thread_pool->threads = malloc(num_threads * sizeof(pthread_t));
-    for(u32 i = 0; i < num_threads; i++) {
-        if(pthread_create(&thread_pool->threads[i], NULL, thread_func, thread_pool) != 0) {
+    for(u32 i = 0; i < TASK_PRIORITY_COUNT; i++) {
+        thread_pool->queues[i] = (TaskQueue) {0};
+    }
+    thread_pool->frame_arena = NULL;
+
+    thread_pool->threads = tracked_malloc(MEMORY_TAG_THREAD_POOL, total_threads * sizeof(pthread_t));
+    thread_pool->workers = tracked_malloc(MEMORY_TAG_THREAD_POOL, total_threads * sizeof(ThreadPoolWorker));
+    for(u32 i = 0; i < total_threads; i++) {
+        bool background = i >= num_threads;
+        thread_pool->workers[i] = (ThreadPoolWorker) {
+            .pool = thread_pool,
+            .affinity = background ? &thread_pool->background_affinity : &thread_pool->affinity,
+            .index = background ? i - num_threads : i,
+            .priority = background ? TASK_PRIORITY_BACKGROUND : TASK_PRIORITY_FRAME
+        };
+        if(pthread_create(&thread_pool->threads[i], NULL, thread_func, &thread_pool->workers[i]) != 0) {
             fprintf(stderr, "Failed to create thread %u in thread pool\n", i);
             return;
         }
@@ -108,56 +162,148 @@ void init_thread_pool(ThreadPool *thread_pool, u32 num_threads) {
 }
 
 void destroy_thread_pool(ThreadPool *pool) {
-    Task *task1, *task2;
+    Task *cancelled = NULL;
 
     if(!pool) {
         return;
     }
 
     pthread_mutex_lock(&pool->mutex);
-    task1 = pool->last_task;
-    while(task1) {
-        task2 = task1->next;
-        destroy_task(task1);
-        task1 = task2;
+    for(u32 i = 0; i < TASK_PRIORITY_COUNT; i++) {
+        TaskQueue *queue = &pool->queues[i];
+        if(queue->first_task) {
+            queue->first_task->next = cancelled;
+            cancelled = queue->last_task;
+        }
+        queue->last_task = NULL;
+        queue->first_task = NULL;
     }
-    pool->last_task = NULL;
     pool->active = false;
 
     pthread_cond_broadcast(&pool->task_cond);
     pthread_mutex_unlock(&pool->mutex);
 
+    while(cancelled) {
+        Task *next = cancelled->next;
+        cancel_task(cancelled);
+        cancelled = next;
+    }
+
     thread_pool_wait(pool);
 
     pthread_mutex_destroy(&pool->mutex);
     pthread_cond_destroy(&pool->task_cond);
     pthread_cond_destroy(&pool->working_cond);
+
+    tracked_free(pool->threads);
+    tracked_free(pool->workers);
+}
+
+static bool enqueue_task(ThreadPool *pool, Task *task) {
+    if(!pool || !task) {
+        return false;
+    }
+
+    TaskQueue *queue = &pool->queues[task->priority];
+    if(queue->first_task) {
+        queue->first_task->next = task;
+        queue->first_task = task;
+    } else {
+        queue->first_task = task;
+        queue->last_task = task;
+    }
+
+    pthread_cond_broadcast(&pool->task_cond);
+
+    return true;
 }
 
 // !!! NEEDS A LOCKED MUTEX !!!
 bool push_task(ThreadPool *pool, task_func func, void *arg) {
-    Task *task;
+    if(!pool || !func) {
+        return false;
+    }
+
+    if(!pool->frame_arena) {
+        return enqueue_task(pool, create_task(func, arg));
+    }
 
+    Task *task = arena_alloc(pool->frame_arena, sizeof(Task));
+    *task = (Task) {
+        .func = func,
+        .arg = arg,
+        .priority = TASK_PRIORITY_FRAME,
+        .arena_allocated = true
+    };
+    return enqueue_task(pool, task);
+}
+
+bool push_background_task(ThreadPool *pool, task_func func, task_func cancel_func, void *arg, const void *owner) {
     if(!pool) {
         return false;
     }
 
-    task = create_task(func, arg);
+    Task *task = create_task(func, arg);
     if(!task) {
         return false;
     }
+    task->cancel_func = cancel_func;
+    task->owner = owner;
+    task->priority = TASK_PRIORITY_BACKGROUND;
 
-    if(pool->first_task) {
-        pool->first_task->next = task;
-        pool->first_task = task;
-    } else {
-        pool->first_task = task;
-        pool->last_task = task;
+    pthread_mutex_lock(&pool->mutex);
+    bool result = enqueue_task(pool, task);
+    pthread_mutex_unlock(&pool->mutex);
+    return result;
+}
+
+u32 cancel_tasks(ThreadPool *pool, const void *owner) {
+    Task *cancelled = NULL;
+    u32 count = 0;
+
+    if(!pool || !owner) {
+        return 0;
     }
 
-    pthread_cond_broadcast(&pool->task_cond);
+    pthread_mutex_lock(&pool->mutex);
+    for(u32 i = 0; i < TASK_PRIORITY_COUNT; i++) {
+        TaskQueue *queue = &pool->queues[i];
+        Task *previous = NULL;
+        Task *task = queue->last_task;
+        while(task) {
+            Task *next = task->next;
+            if(task->owner == owner) {
+                if(previous) {
+                    previous->next = next;
+                } else {
+                    queue->last_task = next;
+                }
+                if(queue->first_task == task) {
+                    queue->first_task = previous;
+                }
+
+                task->next = cancelled;
+                cancelled = task;
+                count++;
+            } else {
+                previous = task;
+            }
+            task = next;
+        }
 
-    return true;
+        if(is_idle(pool, i)) {
+            pthread_cond_broadcast(&pool->working_cond);
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    while(cancelled) {
+        Task *next = cancelled->next;
+        cancel_task(cancelled);
+        cancelled = next;
+    }
+
+    return count;
 }
 
 void thread_pool_wait(ThreadPool *pool) {
@@ -167,11 +313,23 @@ void thread_pool_wait(ThreadPool *pool) {
 
     pthread_mutex_lock(&pool->mutex);
     while(1) {
-        if(pool->last_task || (pool->active && pool->working_threads != 0) || (!pool->active && pool->num_threads != 0)) {
+        if(has_task(pool, ~0u) || (pool->active && pool->working_threads != 0) || (!pool->active && pool->num_threads != 0)) {
             pthread_cond_wait(&pool->working_cond, &pool->mutex);
         } else {
             break;
         }
     }
     pthread_mutex_unlock(&pool->mutex);
-}
\ No newline at end of file
+}
+
+void thread_pool_wait_priority(ThreadPool *pool, TaskPriority priority) {
+    if(!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    while(pool->active && !is_idle(pool, priority)) {
+        pthread_cond_wait(&pool->working_cond, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
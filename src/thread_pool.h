@@ -5,24 +5,66 @@
 #include <pthread.h>
 
 #include "util.h"
+#include "topology.h"
+#include "arena.h"
 
 typedef void (*task_func)(void *arg);
 
+// Lower value = higher priority
+typedef enum {
+    // Per-frame work, render_wait() blocks on these
+    TASK_PRIORITY_FRAME = 0,
+    // Chunk generation/meshing, never waited on by the frame
+    TASK_PRIORITY_BACKGROUND = 1,
+    TASK_PRIORITY_COUNT
+} TaskPriority;
+
+#define TASK_PRIORITY_BIT(p) (1u << (p))
+
 // Next = next to be processed
 typedef struct Task {
     struct Task *next;
     task_func func;
+    // Called instead of func if the task is cancelled before it runs, may be NULL
+    task_func cancel_func;
     void *arg;
+    // Used to find tasks to cancel, may be NULL
+    const void *owner;
+    TaskPriority priority;
+    // Frame tasks come from the pool's frame arena and are not freed individually
+    bool arena_allocated;
 } Task;
 
 typedef struct {
+    Task *first_task;
+    Task *last_task;
+    // Tasks of this priority currently being run
+    u32 working_threads;
+} TaskQueue;
+
+struct ThreadPool;
+
+typedef struct {
+    struct ThreadPool *pool;
+    const ThreadAffinity *affinity;
+    u32 index;
+    // The only priority this worker takes tasks from, so background work never occupies a frame worker
+    TaskPriority priority;
+} ThreadPoolWorker;
+
+typedef struct ThreadPool {
     pthread_t *threads;
+    ThreadPoolWorker *workers;
+    ThreadAffinity affinity;
+    ThreadAffinity background_affinity;
     bool active;
     u32 num_threads;
     u32 working_threads;
 
-    Task *first_task;
-    Task *last_task;
+    TaskQueue queues[TASK_PRIORITY_COUNT];
+    // If set frame tasks are allocated from here, the owner must reset it only once all frame tasks are done
+    // Only touched with the mutex locked
+    Arena *frame_arena;
     pthread_mutex_t mutex;
     pthread_cond_t task_cond;
     pthread_cond_t working_cond;
@@ -31,9 +73,27 @@ typedef struct {
 Task *create_task(task_func func, void *arg);
 void destroy_task(Task *task);
 
-void init_thread_pool(ThreadPool *thread_pool, u32 num_threads);
+// Frame workers only take frame tasks, background workers only take background tasks
+// affinities may be NULL
+void init_thread_pool(
+    ThreadPool *thread_pool,
+    u32 num_threads,
+    const ThreadAffinity *affinity,
+    u32 num_background_threads,
+    const ThreadAffinity *background_affinity);
 void destroy_thread_pool(ThreadPool *pool);
+
+// Pushes a frame task
 bool push_task(ThreadPool *pool, task_func func, void *arg);
+// Pushes a background task, locks the mutex itself
+bool push_background_task(ThreadPool *pool, task_func func, task_func cancel_func, void *arg, const void *owner);
+// Removes queued background tasks belonging to owner and calls their cancel_func, returns the number cancelled
+// Tasks that are already running are not affected
+u32 cancel_tasks(ThreadPool *pool, const void *owner);
+
+// Waits for every task
 void thread_pool_wait(ThreadPool *pool);
+// Waits until no task of the given priority is queued or running
+void thread_pool_wait_priority(ThreadPool *pool, TaskPriority priority);
 
-#endif
\ No newline at end of file
+#endif
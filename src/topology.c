@@ -0,0 +1,192 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include "topology.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+// Nice increment for background threads
+#define LOW_PRIORITY_NICE 10
+
+static bool read_sysfs_u32(u32 cpu, const char *name, u32 *out) {
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/%s", cpu, name);
+
+    FILE *file = fopen(path, "r");
+    if(!file) {
+        return false;
+    }
+
+    bool ok = fscanf(file, "%u", out) == 1;
+    fclose(file);
+    return ok;
+}
+
+Topology detect_topology() {
+    Topology topology = {0};
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    topology.logical_cpus = cpus > 0 ? cpus : 1;
+    topology.physical_cores = topology.logical_cpus;
+    topology.packages = 1;
+
+    // (package, core) pairs seen so far, SMT siblings share one
+    u32 seen_packages[MAX_CORES];
+    u32 seen_cores[MAX_CORES];
+    u32 seen_count = 0;
+    u32 max_package = 0;
+
+    for(u32 cpu = 0; cpu < topology.logical_cpus && cpu < MAX_CORES; cpu++) {
+        u32 package, core;
+        if(!read_sysfs_u32(cpu, "physical_package_id", &package)
+            || !read_sysfs_u32(cpu, "core_id", &core)) {
+            return topology;
+        }
+
+        bool found = false;
+        for(u32 i = 0; i < seen_count; i++) {
+            if(seen_packages[i] == package && seen_cores[i] == core) {
+                found = true;
+                break;
+            }
+        }
+
+        if(!found) {
+            seen_packages[seen_count] = package;
+            seen_cores[seen_count] = core;
+            seen_count++;
+        }
+
+        if(package > max_package) {
+            max_package = package;
+        }
+    }
+
+    if(seen_count > 0) {
+        topology.physical_cores = seen_count;
+        topology.packages = max_package + 1;
+    }
+
+    return topology;
+}
+
+void print_topology(const Topology *topology) {
+    printf(
+        "CPU topology: %u logical CPUs, %u physical cores, %u package(s)\n",
+        topology->logical_cpus,
+        topology->physical_cores,
+        topology->packages);
+}
+
+void core_set_add(CoreSet *set, u32 core) {
+    if(set->count >= MAX_CORES) {
+        return;
+    }
+
+    for(u32 i = 0; i < set->count; i++) {
+        if(set->cores[i] == core) {
+            return;
+        }
+    }
+
+    set->cores[set->count] = core;
+    set->count++;
+}
+
+bool parse_core_set(const char *str, CoreSet *set) {
+    set->count = 0;
+
+    const char *c = str;
+    while(*c) {
+        char *end;
+        long first = strtol(c, &end, 10);
+        if(end == c || first < 0) {
+            return false;
+        }
+        long last = first;
+        c = end;
+
+        if(*c == '-') {
+            c++;
+            last = strtol(c, &end, 10);
+            if(end == c || last < first) {
+                return false;
+            }
+            c = end;
+        }
+
+        for(long core = first; core <= last && core < MAX_CORES; core++) {
+            core_set_add(set, core);
+        }
+
+        if(*c == ',') {
+            c++;
+        } else if(*c) {
+            return false;
+        }
+    }
+
+    return set->count > 0;
+}
+
+bool pin_thread(pthread_t thread, const u32 *cores, u32 count) {
+#ifdef __linux__
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    for(u32 i = 0; i < count; i++) {
+        CPU_SET(cores[i], &cpu_set);
+    }
+
+    if(pthread_setaffinity_np(thread, sizeof(cpu_set), &cpu_set) != 0) {
+        fprintf(stderr, "Failed to set thread affinity\n");
+        return false;
+    }
+    return true;
+#else
+    (void) thread;
+    (void) cores;
+    (void) count;
+    return false;
+#endif
+}
+
+bool lower_thread_priority() {
+#ifdef __linux__
+    // On Linux nice values are per thread
+    pid_t tid = syscall(SYS_gettid);
+    if(setpriority(PRIO_PROCESS, tid, LOW_PRIORITY_NICE) != 0) {
+        fprintf(stderr, "Failed to lower thread priority\n");
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+void apply_thread_affinity(const ThreadAffinity *affinity, u32 index) {
+    if(!affinity) {
+        return;
+    }
+
+    if(affinity->cores.count > 0) {
+        if(affinity->one_core_per_thread) {
+            pin_thread(pthread_self(), &affinity->cores.cores[index % affinity->cores.count], 1);
+        } else {
+            pin_thread(pthread_self(), affinity->cores.cores, affinity->cores.count);
+        }
+    }
+
+    if(affinity->low_priority) {
+        lower_thread_priority();
+    }
+}
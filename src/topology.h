@@ -0,0 +1,42 @@
+#ifndef _TOPOLOGY_H
+#define _TOPOLOGY_H
+
+#include <pthread.h>
+
+#include "util.h"
+
+#define MAX_CORES 256
+
+typedef struct {
+    u32 cores[MAX_CORES];
+    u32 count;
+} CoreSet;
+
+typedef struct {
+    u32 logical_cpus;
+    u32 physical_cores;
+    u32 packages;
+} Topology;
+
+typedef struct {
+    // Empty set means the scheduler decides
+    CoreSet cores;
+    // If true thread i is pinned to cores[i % count], otherwise every thread may run on the whole set
+    bool one_core_per_thread;
+    bool low_priority;
+} ThreadAffinity;
+
+Topology detect_topology();
+void print_topology(const Topology *topology);
+
+// Parses lists like "0-3,6,8-9"
+bool parse_core_set(const char *str, CoreSet *set);
+void core_set_add(CoreSet *set, u32 core);
+
+bool pin_thread(pthread_t thread, const u32 *cores, u32 count);
+bool lower_thread_priority();
+
+// Applies an affinity to the calling thread, index is the thread's index in its group
+void apply_thread_affinity(const ThreadAffinity *affinity, u32 index);
+
+#endif
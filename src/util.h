@@ -23,6 +23,10 @@ typedef double f64;
 
 #define MOD(x, y) (((x) % (y) + (y)) % (y))
 
+#define CACHE_LINE_SIZE 64
+// Rounds x up to a multiple of a
+#define ALIGN_UP(x, a) ((((x) + (a) - 1) / (a)) * (a))
+
 typedef struct {
     vec3s pos;
     vec3s size;
@@ -31,6 +35,7 @@ typedef struct {
 bool aabb_colliding(AABB a, AABB b);
 
 #define NS_PER_SECOND 1000000000
+#define NS_PER_MS 1000000ull
 u64 ns_now();
 
 void *memset32(void *s, u32 c, u64 n);
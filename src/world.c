@@ -2,6 +2,11 @@
 #include "noise.h"
 #include "player.h"
 #include "xorshift.h"
+#include "memory.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 // Tree generation chance per block (1/n)
 #define TREE_GENERATION_CHANCE 200
@@ -10,6 +15,16 @@ Block blocks[MAX_BLOCK_ID + 1];
 
 World world;
 
+static const ivec2s neighbour_offsets[CHUNK_NEIGHBOUR_COUNT] = {
+    [CHUNK_NEIGHBOUR_NEG_X] = {{-1, 0}},
+    [CHUNK_NEIGHBOUR_POS_X] = {{1, 0}},
+    [CHUNK_NEIGHBOUR_NEG_Z] = {{0, -1}},
+    [CHUNK_NEIGHBOUR_POS_Z] = {{0, 1}}
+};
+
+// NEG_X <-> POS_X, NEG_Z <-> POS_Z
+#define OPPOSITE_NEIGHBOUR(n) ((n) ^ 1)
+
 void init_blocks() {
     blocks[BLOCK_AIR] = (Block) {
         .type = BLOCK_AIR,
@@ -143,475 +158,748 @@ void init_blocks() {
     };
 }
 
-void destroy_chunk(Chunk *chunk) {
-    if(chunk->mesh.vertices) {
-        free(chunk->mesh.vertices);
+// Empties every section, the index buffers go back to the free list
+static void clear_chunk_sections(Chunk *chunk) {
+    for(u32 i = 0; i < SECTION_COUNT; i++) {
+        clear_section(&chunk->sections[i]);
     }
+    memset(chunk->heightmap, 0, sizeof(chunk->heightmap));
+    chunk->height = 0;
+}
+
+// Mesh buffers hold 16, 20, 24, 28, 32, 40, ... quads, four classes per power of two so at most a fifth is unused
+// The last class fits the most faces a section can have, all six faces of every block
+// Transparent blocks only hide faces against their own type, so a checkerboard of glass and leaves shows all of them
+#define MIN_MESH_QUADS 16
+#define MESH_CLASS_COUNT 43
+#define MAX_SECTION_FACES (SECTION_VOLUME * 6)
+
+// Mesh buffers of unloaded chunks and replaced meshes, per size, reused before allocating new ones
+// Mesh jobs allocate from it on the background workers
+static struct {
+    PackedVertex **buffers;
+    u32 count;
+    u32 allocated;
+} free_meshes[MESH_CLASS_COUNT];
+static pthread_mutex_t free_meshes_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static u32 mesh_class_quads(u32 class) {
+    return (4 + class % 4) << (class / 4 + 2);
+}
 
-    if(chunk->mesh.faces) {
-        free(chunk->mesh.faces);
+// Smallest class holding the quads
+static u32 mesh_class(u32 quads) {
+    if(quads <= MIN_MESH_QUADS) {
+        return 0;
     }
+
+    // Classes above 2^bits are a quarter of 2^bits apart
+    u32 bits = 31 - __builtin_clz(quads - 1);
+    return (bits - 4) * 4 + ((quads - 1 - (1u << bits)) >> (bits - 2)) + 1;
 }
 
-static void push_vertex(Chunk *chunk, const Vertex *v) {
-    if(!chunk->mesh.vertices) {
-        chunk->mesh.vertices = malloc(128 * sizeof(Vertex));
-        chunk->mesh.vertex_count_alloc = 128;
+// Empty meshes get no buffer
+static void alloc_mesh_buffer(MeshBuffer *mesh, u32 quads) {
+    *mesh = (MeshBuffer) {0};
+    if(quads == 0) {
+        return;
     }
 
-    if(chunk->mesh.vertex_count >= chunk->mesh.vertex_count_alloc) {
-        chunk->mesh.vertices = realloc(chunk->mesh.vertices, chunk->mesh.vertex_count_alloc * 2 * sizeof(Vertex));
-        chunk->mesh.vertex_count_alloc *= 2;
+    u32 class = mesh_class(quads);
+    mesh->vertex_count_alloc = mesh_class_quads(class) * 4;
+
+    pthread_mutex_lock(&free_meshes_mutex);
+    if(free_meshes[class].count > 0) {
+        free_meshes[class].count--;
+        mesh->vertices = free_meshes[class].buffers[free_meshes[class].count];
     }
+    pthread_mutex_unlock(&free_meshes_mutex);
 
-    chunk->mesh.vertices[chunk->mesh.vertex_count] = *v;
-    chunk->mesh.vertex_count++;
+    if(!mesh->vertices) {
+        mesh->vertices = tracked_malloc(MEMORY_TAG_WORLD, mesh->vertex_count_alloc * sizeof(PackedVertex));
+    }
 }
 
-static void try_mesh_left_face(Chunk *chunk, u8 x, u8 y, u8 z) {
-    Block *block = chunk_get(chunk, x, y, z);
-    if(x > 0) {
-        Block *other_block = chunk_get(chunk, x - 1, y, z);
-        bool both_transparent = block->transparent && other_block->transparent;
-        bool both_non_transparent = !block->transparent && !other_block->transparent;
-        bool both_same_type = block->type == other_block->type;
+static void free_mesh_buffer(MeshBuffer *mesh) {
+    if(!mesh->vertices) {
+        return;
+    }
 
-        if((both_transparent && both_same_type)
-            || (both_non_transparent)
-            || (block->transparent && !both_transparent && !both_non_transparent)) {
-            return;
+    u32 class = mesh_class(mesh->vertex_count_alloc / 4);
+    pthread_mutex_lock(&free_meshes_mutex);
+    if(!free_meshes[class].buffers) {
+        free_meshes[class].buffers = tracked_malloc(MEMORY_TAG_WORLD, 32 * sizeof(PackedVertex*));
+        free_meshes[class].allocated = 32;
+    }
+
+    if(free_meshes[class].count >= free_meshes[class].allocated) {
+        free_meshes[class].buffers = tracked_realloc(
+            MEMORY_TAG_WORLD,
+            free_meshes[class].buffers,
+            2 * free_meshes[class].allocated * sizeof(PackedVertex*));
+        free_meshes[class].allocated *= 2;
+    }
+
+    free_meshes[class].buffers[free_meshes[class].count] = mesh->vertices;
+    free_meshes[class].count++;
+    pthread_mutex_unlock(&free_meshes_mutex);
+
+    *mesh = (MeshBuffer) {0};
+}
+
+// Frees the buffers kept on the free list, only once no mesh job runs
+static void destroy_mesh_buffers() {
+    for(u32 class = 0; class < MESH_CLASS_COUNT; class++) {
+        for(u32 i = 0; i < free_meshes[class].count; i++) {
+            tracked_free(free_meshes[class].buffers[i]);
         }
+        tracked_free(free_meshes[class].buffers);
+        memset(&free_meshes[class], 0, sizeof(free_meshes[class]));
     }
+}
+
+void destroy_chunk(Chunk *chunk) {
+    clear_chunk_sections(chunk);
 
-    Chunk *neighbour = get_chunk(chunk->pos.x - 1, chunk->pos.y);
-    if(neighbour) {
-        Block *corresponding_block = chunk_get(neighbour, CHUNK_WIDTH - 1, y, z);
-        if(x == 0 && corresponding_block->type != BLOCK_AIR) {
-            return;
+    for(i32 i = 0; i < SECTION_COUNT; i++) {
+        free_mesh_buffer(&chunk->mesh.front[i]);
+    }
+}
+
+typedef enum {
+    FACE_NEG_X,
+    FACE_POS_X,
+    FACE_NEG_Z,
+    FACE_POS_Z,
+    FACE_NEG_Y,
+    FACE_POS_Y,
+    FACE_COUNT
+} FaceDirection;
+
+// Faces are merged on a 2D grid per slice, u and v are the grid axes and match the texture's axes
+typedef struct {
+    ivec3s normal;
+    // 0 = x, 1 = y, 2 = z
+    u8 slice_axis;
+    u8 u_axis;
+    u8 v_axis;
+    // 255 is full brightness
+    u8 light;
+    // Corners of the face in units of its size along u and v, wound the same way for every face
+    ivec2s corners[4];
+} FaceInfo;
+
+static const FaceInfo face_infos[FACE_COUNT] = {
+    [FACE_NEG_X] = {{{-1, 0, 0}}, 0, 2, 1, 204, {{{1, 0}}, {{0, 0}}, {{0, 1}}, {{1, 1}}}},
+    [FACE_POS_X] = {{{1, 0, 0}}, 0, 2, 1, 204, {{{0, 0}}, {{1, 0}}, {{1, 1}}, {{0, 1}}}},
+    [FACE_NEG_Z] = {{{0, 0, -1}}, 2, 0, 1, 217, {{{0, 0}}, {{1, 0}}, {{1, 1}}, {{0, 1}}}},
+    [FACE_POS_Z] = {{{0, 0, 1}}, 2, 0, 1, 217, {{{1, 0}}, {{0, 0}}, {{0, 1}}, {{1, 1}}}},
+    [FACE_NEG_Y] = {{{0, -1, 0}}, 1, 0, 2, 153, {{{0, 0}}, {{1, 0}}, {{1, 1}}, {{0, 1}}}},
+    [FACE_POS_Y] = {{{0, 1, 0}}, 1, 0, 2, 255, {{{0, 1}}, {{1, 1}}, {{1, 0}}, {{0, 0}}}}
+};
+
+static vec2s face_tex_coords(const Block *block, FaceDirection direction) {
+    switch(direction) {
+        case FACE_NEG_X: return block->tex_coords.neg_x;
+        case FACE_POS_X: return block->tex_coords.pos_x;
+        case FACE_NEG_Z: return block->tex_coords.neg_z;
+        case FACE_POS_Z: return block->tex_coords.pos_z;
+        case FACE_NEG_Y: return block->tex_coords.neg_y;
+        default: return block->tex_coords.pos_y;
+    }
+}
+
+// Atlas tile of a face, numbered row by row
+static u8 face_tile(const Block *block, FaceDirection direction) {
+    vec2s tex_coords = face_tex_coords(block, direction);
+    return roundf(tex_coords.x / ATLAS_TILE_SIZE) + roundf(tex_coords.y / ATLAS_TILE_SIZE) * ATLAS_TILES_PER_ROW;
+}
+
+// Emits a face covering size.x by size.y blocks, the texture repeats once per block
+static void push_face(MeshBuffer *mesh, const Block *block, FaceDirection direction, ivec3s origin, ivec2s size) {
+    const FaceInfo *info = &face_infos[direction];
+    u8 tile = face_tile(block, direction);
+
+    PackedVertex corners[4];
+    for(u32 i = 0; i < 4; i++) {
+        ivec2s corner = info->corners[i];
+        i32 pos[3] = {origin.x, origin.y, origin.z};
+        // Faces on the positive side sit on the far side of the block
+        if(info->normal.x + info->normal.y + info->normal.z > 0) {
+            pos[info->slice_axis]++;
         }
-    } else {
-        if(x == 0) {
-            return;
-        }
-    }
-
-    vec2s tex_coords = blocks[block->type].tex_coords.neg_x;
-    push_vertex(chunk, &(Vertex) {
-        (vec3s) {x, y, z + 1},
-        1.0f,
-        tex_coords,
-        0.8f
-    });
-    tex_coords.x += 1.0f / 8.0f;
-    push_vertex(chunk, &(Vertex) {
-        (vec3s) {x, y, z},
-        1.0f,
-        tex_coords,
-        0.8f
-    });
-    tex_coords.y += 1.0f / 8.0f;
-    push_vertex(chunk, &(Vertex) {
-        (vec3s) {x, y + 1, z},
-        1.0f,
-        tex_coords,
-        0.8f
-    });
-    push_vertex(chunk, &(Vertex) {
-        (vec3s) {x, y + 1, z},
-        1.0f,
-        tex_coords,
-        0.8f
-    });
-    tex_coords.x -= 1.0f / 8.0f;
-    push_vertex(chunk, &(Vertex) {
-        (vec3s) {x, y + 1, z + 1},
-        1.0f,
-        tex_coords,
-        0.8f
-    });
-    tex_coords.y -= 1.0f / 8.0f;
-    push_vertex(chunk, &(Vertex) {
-        (vec3s) {x, y, z + 1},
-        1.0f,
-        tex_coords,
-        0.8f
-    });
-}
-
-static void try_mesh_right_face(Chunk *chunk, u8 x, u8 y, u8 z) {
-    Block *block = chunk_get(chunk, x, y, z);
-    if(x < CHUNK_WIDTH - 1) {
-        Block *other_block = chunk_get(chunk, x + 1, y, z);
-        bool both_transparent = block->transparent && other_block->transparent;
-        bool both_non_transparent = !block->transparent && !other_block->transparent;
-        bool both_same_type = block->type == other_block->type;
-
-        if((both_transparent && both_same_type)
-            || (both_non_transparent)
-            || (block->transparent && !both_transparent && !both_non_transparent)) {
-            return;
-        }
-    }
-
-    Chunk *neighbour = get_chunk(chunk->pos.x + 1, chunk->pos.y);
-    if(neighbour) {
-        Block *corresponding_block = chunk_get(neighbour, 0, y, z);
-        if(x == CHUNK_WIDTH - 1 && corresponding_block->type != BLOCK_AIR) {
-            return;
+        pos[info->u_axis] += corner.x * size.x;
+        pos[info->v_axis] += corner.y * size.y;
+
+        corners[i] = (PackedVertex) {
+            .x = pos[0],
+            .y = pos[1],
+            .z = pos[2],
+            .light = info->light,
+            .tile = tile,
+            .u = corner.x * size.x,
+            .v = corner.y * size.y
+        };
+    }
+
+    // The buffer was allocated for every face of the section
+    memcpy(&mesh->vertices[mesh->vertex_count], corners, sizeof(corners));
+    mesh->vertex_count += 4;
+}
+
+// Block types of a chunk with a one block border taken from its neighbours, indexed [y + 1][z + 1][x + 1]
+// Mesh jobs only read this copy, so the main thread can keep editing the chunks while they run
+// The layers below and above the world are air, corners of the border are unused
+typedef struct {
+    u8 blocks[CHUNK_HEIGHT + 2][CHUNK_DEPTH + 2][CHUNK_WIDTH + 2];
+    // The chunk's height, every block at or above it is air
+    u8 height;
+} ChunkSnapshot;
+
+// Border blocks of a neighbour that is not loaded, only has to be non-air so it hides the faces next to it
+#define MISSING_NEIGHBOUR_BLOCK MAX_BLOCK_ID
+
+#define ALL_SECTIONS ((1u << SECTION_COUNT) - 1)
+
+#define SNAPSHOT_ROW_STRIDE (CHUNK_WIDTH + 2)
+#define SNAPSHOT_LAYER_STRIDE ((CHUNK_WIDTH + 2) * (CHUNK_DEPTH + 2))
+
+static u8 snapshot_get(const ChunkSnapshot *snapshot, i32 x, i32 y, i32 z) {
+    return snapshot->blocks[y + 1][z + 1][x + 1];
+}
+
+// Copies the neighbour's blocks that touch the chunk into the border on that side, only in the given sections
+static void snapshot_border(ChunkSnapshot *snapshot, const Chunk *neighbour, ChunkNeighbour side, u32 sections) {
+    ivec2s offset = neighbour_offsets[side];
+    // Where the border is in the snapshot, and which blocks of the neighbour it mirrors
+    i32 x = offset.x < 0 ? -1 : CHUNK_WIDTH;
+    i32 z = offset.y < 0 ? -1 : CHUNK_DEPTH;
+    u32 source = offset.x != 0 ? MOD(x, CHUNK_WIDTH) : MOD(z, CHUNK_DEPTH) * CHUNK_WIDTH;
+    u32 step = offset.x != 0 ? CHUNK_WIDTH : 1;
+
+    for(i32 y = 0; y < CHUNK_HEIGHT; y++) {
+        if(!(sections & (1u << (y / SECTION_SIZE)))) {
+            continue;
         }
-    } else {
-        if(x == CHUNK_WIDTH - 1) {
-            return;
-        }
-    }
-
-    vec2s tex_coords = blocks[block->type].tex_coords.pos_x;
-    push_vertex(chunk, &(Vertex) {
-        (vec3s) {x + 1, y, z},
-        1.0f,
-        tex_coords,
-        0.8f
-    });
-    tex_coords.x += 1.0f / 8.0f;
-    push_vertex(chunk, &(Vertex) {
-        (vec3s) {x + 1, y, z + 1},
-        1.0f,
-        tex_coords,
-        0.8f
-    });
-    tex_coords.y += 1.0f / 8.0f;
-    push_vertex(chunk, &(Vertex) {
-        (vec3s) {x + 1, y + 1, z + 1},
-        1.0f,
-        tex_coords,
-        0.8f
-    });
-    push_vertex(chunk, &(Vertex) {
-        (vec3s) {x + 1, y + 1, z + 1},
-        1.0f,
-        tex_coords,
-        0.8f
-    });
-    tex_coords.x -= 1.0f / 8.0f;
-    push_vertex(chunk, &(Vertex) {
-        (vec3s) {x + 1, y + 1, z},
-        1.0f,
-        tex_coords,
-        0.8f
-    });
-    tex_coords.y -= 1.0f / 8.0f;
-    push_vertex(chunk, &(Vertex) {
-        (vec3s) {x + 1, y, z},
-        1.0f,
-        tex_coords,
-        0.8f
-    });
-}
-
-static void try_mesh_front_face(Chunk *chunk, u8 x, u8 y, u8 z) {
-    Block *block = chunk_get(chunk, x, y, z);
-    if(z > 0) {
-        Block *other_block = chunk_get(chunk, x, y, z - 1);
-        bool both_transparent = block->transparent && other_block->transparent;
-        bool both_non_transparent = !block->transparent && !other_block->transparent;
-        bool both_same_type = block->type == other_block->type;
-
-        if((both_transparent && both_same_type)
-            || (both_non_transparent)
-            || (block->transparent && !both_transparent && !both_non_transparent)) {
-            return;
-        }
-    }
-
-    Chunk *neighbour = get_chunk(chunk->pos.x, chunk->pos.y - 1);
-    if(neighbour) {
-        Block *corresponding_block = chunk_get(neighbour, x, y, CHUNK_DEPTH - 1);
-        if(z == 0 && corresponding_block->type != BLOCK_AIR) {
-            return;
+
+        const ChunkSection *section = neighbour ? &neighbour->sections[y / SECTION_SIZE] : NULL;
+        u32 layer = (y % SECTION_SIZE) * CHUNK_WIDTH * CHUNK_DEPTH;
+
+        for(i32 i = 0; i < SECTION_SIZE; i++) {
+            u8 type = section ? section_get(section, source + i * step + layer) : MISSING_NEIGHBOUR_BLOCK;
+            if(offset.x != 0) {
+                snapshot->blocks[y + 1][i + 1][x + 1] = type;
+            } else {
+                snapshot->blocks[y + 1][z + 1][i + 1] = type;
+            }
         }
-    } else {
-        if(z == 0) {
-            return;
-        }
-    }
-    vec2s tex_coords = blocks[block->type].tex_coords.neg_z;
-    push_vertex(chunk, &(Vertex) {
-        (vec3s) {x, y, z},
-        1.0f,
-        tex_coords,
-        0.85f
-    });
-    tex_coords.x += 1.0f / 8.0f;
-    push_vertex(chunk, &(Vertex) {
-        (vec3s) {x + 1, y, z},
-        1.0f,
-        tex_coords,
-        0.85f
-    });
-    tex_coords.y += 1.0f / 8.0f;
-    push_vertex(chunk, &(Vertex) {
-        (vec3s) {x + 1, y + 1, z},
-        1.0f,
-        tex_coords,
-        0.85f
-    });
-    push_vertex(chunk, &(Vertex) {
-        (vec3s) {x + 1, y + 1, z},
-        1.0f,
-        tex_coords,
-        0.85f
-    });
-    tex_coords.x -= 1.0f / 8.0f;
-    push_vertex(chunk, &(Vertex) {
-        (vec3s) {x, y + 1, z},
-        1.0f,
-        tex_coords,
-        0.85f
-    });
-    tex_coords.y -= 1.0f / 8.0f;
-    push_vertex(chunk, &(Vertex) {
-        (vec3s) {x, y, z},
-        1.0f,
-        tex_coords,
-        0.85f
-    });
-}
-
-static void try_mesh_back_face(Chunk *chunk, u8 x, u8 y, u8 z) {
-    Block *block = chunk_get(chunk, x, y, z);
-    if(z < CHUNK_DEPTH - 1) {
-        Block *other_block = chunk_get(chunk, x, y, z + 1);
-        bool both_transparent = block->transparent && other_block->transparent;
-        bool both_non_transparent = !block->transparent && !other_block->transparent;
-        bool both_same_type = block->type == other_block->type;
-
-        if((both_transparent && both_same_type)
-            || (both_non_transparent)
-            || (block->transparent && !both_transparent && !both_non_transparent)) {
-            return;
-        }
-    }
-
-    Chunk *neighbour = get_chunk(chunk->pos.x, chunk->pos.y + 1);
-    if(neighbour) {
-        Chunk *neighbour = get_chunk(chunk->pos.x, chunk->pos.y + 1);
-        Block *corresponding_block = chunk_get(neighbour, x, y, 0);
-        if(z == CHUNK_DEPTH - 1 && corresponding_block->type != BLOCK_AIR) {
-            return;
+    }
+}
+
+// Only fills in what meshing the given sections reads, their blocks and borders plus the sections above and below
+static void take_snapshot(Chunk *chunk, ChunkSnapshot *snapshot, u32 sections) {
+    memset(snapshot->blocks, BLOCK_AIR, sizeof(snapshot->blocks));
+    snapshot->height = chunk->height;
+
+    u32 unpacked = (sections | (sections << 1) | (sections >> 1)) & ALL_SECTIONS;
+    for(i32 i = 0; i < SECTION_COUNT; i++) {
+        if(!(unpacked & (1u << i))) {
+            continue;
         }
-    } else {
-        if(z == CHUNK_DEPTH - 1) {
-            return;
-        }
-    }
-
-    vec2s tex_coords = blocks[block->type].tex_coords.pos_z;
-    push_vertex(chunk, &(Vertex) {
-        (vec3s) {x + 1, y, z + 1},
-        1.0f,
-        tex_coords,
-        0.85f
-    });
-    tex_coords.x += 1.0f / 8.0f;
-    push_vertex(chunk, &(Vertex) {
-        (vec3s) {x, y, z + 1},
-        1.0f,
-        tex_coords,
-        0.85f
-    });
-    tex_coords.y += 1.0f / 8.0f;
-    push_vertex(chunk, &(Vertex) {
-        (vec3s) {x, y + 1, z + 1},
-        1.0f,
-        tex_coords,
-        0.85f
-    });
-    push_vertex(chunk, &(Vertex) {
-        (vec3s) {x, y + 1, z + 1},
-        1.0f,
-        tex_coords,
-        0.85f
-    });
-    tex_coords.x -= 1.0f / 8.0f;
-    push_vertex(chunk, &(Vertex) {
-        (vec3s) {x + 1, y + 1, z + 1},
-        1.0f,
-        tex_coords,
-        0.85f
-    });
-    tex_coords.y -= 1.0f / 8.0f;
-    push_vertex(chunk, &(Vertex) {
-        (vec3s) {x + 1, y, z + 1},
-        1.0f,
-        tex_coords,
-        0.85f
-    });
-}
-
-static void try_mesh_bottom_face(Chunk *chunk, u8 x, u8 y, u8 z) {
-    Block *block = chunk_get(chunk, x, y, z);
-    if(y > 0) {
-        Block *other_block = chunk_get(chunk, x, y - 1, z);
-        bool both_transparent = block->transparent && other_block->transparent;
-        bool both_non_transparent = !block->transparent && !other_block->transparent;
-        bool both_same_type = block->type == other_block->type;
-
-        if((both_transparent && both_same_type)
-            || (both_non_transparent)
-            || (block->transparent && !both_transparent && !both_non_transparent)) {
-            return;
-        }
-    }
-
-    vec2s tex_coords = blocks[block->type].tex_coords.neg_y;
-    push_vertex(chunk, &(Vertex) {
-        (vec3s) {x, y, z},
-        1.0f,
-        tex_coords,
-        0.6f
-    });
-    tex_coords.x += 1.0f / 8.0f;
-    push_vertex(chunk, &(Vertex) {
-        (vec3s) {x + 1, y, z},
-        1.0f,
-        tex_coords,
-        0.6f
-    });
-    tex_coords.y += 1.0f / 8.0f;
-    push_vertex(chunk, &(Vertex) {
-        (vec3s) {x + 1, y, z + 1},
-        1.0f,
-        tex_coords,
-        0.6f
-    });
-    push_vertex(chunk, &(Vertex) {
-        (vec3s) {x + 1, y, z + 1},
-        1.0f,
-        tex_coords,
-        0.6f
-    });
-    tex_coords.x -= 1.0f / 8.0f;
-    push_vertex(chunk, &(Vertex) {
-        (vec3s) {x, y, z + 1},
-        1.0f,
-        tex_coords,
-        0.6f
-    });
-    tex_coords.y -= 1.0f / 8.0f;
-    push_vertex(chunk, &(Vertex) {
-        (vec3s) {x, y, z},
-        1.0f,
-        tex_coords,
-        0.6f
-    });
-}
-
-static void try_mesh_top_face(Chunk *chunk, u8 x, u8 y, u8 z) {
-    Block *block = chunk_get(chunk, x, y, z);
-    if(y < CHUNK_HEIGHT - 1) {
-        Block *other_block = chunk_get(chunk, x, y + 1, z);
-        bool both_transparent = block->transparent && other_block->transparent;
-        bool both_non_transparent = !block->transparent && !other_block->transparent;
-        bool both_same_type = block->type == other_block->type;
-
-        if((both_transparent && both_same_type)
-            || (both_non_transparent)
-            || (block->transparent && !both_transparent && !both_non_transparent)) {
-            return;
-        }
-    }
-
-    vec2s tex_coords = blocks[block->type].tex_coords.pos_y;
-    push_vertex(chunk, &(Vertex) {
-        (vec3s) {x, y + 1, z + 1},
-        1.0f,
-        tex_coords,
-        1.0f
-    });
-    tex_coords.x += 1.0f / 8.0f;
-    push_vertex(chunk, &(Vertex) {
-        (vec3s) {x + 1, y + 1, z + 1},
-        1.0f,
-        tex_coords,
-        1.0f
-    });
-    tex_coords.y += 1.0f / 8.0f;
-    push_vertex(chunk, &(Vertex) {
-        (vec3s) {x + 1, y + 1, z},
-        1.0f,
-        tex_coords,
-        1.0f
-    });
-    push_vertex(chunk, &(Vertex) {
-        (vec3s) {x + 1, y + 1, z},
-        1.0f,
-        tex_coords,
-        1.0f
-    });
-    tex_coords.x -= 1.0f / 8.0f;
-    push_vertex(chunk, &(Vertex) {
-        (vec3s) {x, y + 1, z},
-        1.0f,
-        tex_coords,
-        1.0f
-    });
-    tex_coords.y -= 1.0f / 8.0f;
-    push_vertex(chunk, &(Vertex) {
-        (vec3s) {x, y + 1, z + 1},
-        1.0f,
-        tex_coords,
-        1.0f
-    });
+
+        section_unpack(
+            &chunk->sections[i],
+            &snapshot->blocks[i * SECTION_SIZE + 1][1][1],
+            SNAPSHOT_ROW_STRIDE,
+            SNAPSHOT_LAYER_STRIDE);
+    }
+
+    for(u32 i = 0; i < CHUNK_NEIGHBOUR_COUNT; i++) {
+        snapshot_border(snapshot, chunk->neighbours[i], i, sections);
+    }
 }
 
-void mesh_chunk(Chunk *chunk, bool update_flag) {
-    chunk->mesh.vertex_count = 0;
+// Rows of blocks along x, bit x + 1 is the block at x and bits 0 and 17 are the blocks in the neighbouring chunks
+// Indexed by [y + 1][z + 1] so the rows around the section are included
+// Sections are cubes, chunks are one section wide and deep
+typedef struct {
+    u32 non_air[SECTION_SIZE + 2][SECTION_SIZE + 2];
+    // Blocks that hide the faces next to them
+    // Blocks in neighbouring chunks hide faces unless they are air, missing neighbours hide every face
+    u32 opaque[SECTION_SIZE + 2][SECTION_SIZE + 2];
+} SectionMasks;
+
+#define ROW_INTERIOR_BITS (((1u << SECTION_SIZE) - 1) << 1)
+#define ROW_BORDER_BITS (1u | (1u << (SECTION_SIZE + 1)))
+
+// Only the rows up to top are built, the ones above are air and only read as neighbours of the row at top
+static void build_section_masks(const ChunkSnapshot *snapshot, i32 section, i32 top, SectionMasks *masks) {
+    for(i32 local_y = -1; local_y <= top; local_y++) {
+        i32 y = section * SECTION_SIZE + local_y;
+
+        for(i32 z = -1; z <= SECTION_SIZE; z++) {
+            const u8 *row = &snapshot->blocks[y + 1][z + 1][0];
+            u32 non_air = 0;
+            u32 opaque = 0;
+            for(u32 i = 0; i < SECTION_SIZE + 2; i++) {
+                if(row[i] != BLOCK_AIR) {
+                    non_air |= 1u << i;
+                }
+                if(!blocks[row[i]].transparent) {
+                    opaque |= 1u << i;
+                }
+            }
 
-    for(u8 x = 0; x < CHUNK_WIDTH; x++) {
-        for(u8 y = 0; y < CHUNK_HEIGHT; y++) {
-            for(u8 z = 0; z < CHUNK_DEPTH; z++) {
-                Block *block = chunk_get(chunk, x, y, z);
-                if(block->type != BLOCK_AIR) {
-                    try_mesh_left_face(chunk, x, y, z);
-                    try_mesh_right_face(chunk, x, y, z);
-                    try_mesh_front_face(chunk, x, y, z);
-                    try_mesh_back_face(chunk, x, y, z);
-                    try_mesh_bottom_face(chunk, x, y, z);
-                    try_mesh_top_face(chunk, x, y, z);
+            // Everything outside the chunk hides faces unless it is air, the layer above the world is air
+            // The floor of the world is never seen, the layer below it hides every face
+            bool border = z < 0 || z == SECTION_SIZE;
+            u32 border_bits = border ? ~0u : ROW_BORDER_BITS;
+            masks->non_air[local_y + 1][z + 1] = non_air;
+            masks->opaque[local_y + 1][z + 1] = y < 0 ? ~0u : (opaque & ~border_bits) | (non_air & border_bits);
+        }
+    }
+}
+
+// Bits of the blocks in a row that show a face in the direction, bit x + 1 for the block at x
+static u32 visible_faces(const ChunkSnapshot *snapshot, const SectionMasks *masks, i32 section, i32 local_y, i32 z, FaceDirection direction) {
+    const FaceInfo *info = &face_infos[direction];
+    i32 row_y = local_y + 1 + info->normal.y;
+    i32 row_z = z + 1 + info->normal.z;
+
+    u32 other_non_air = masks->non_air[row_y][row_z];
+    u32 other_opaque = masks->opaque[row_y][row_z];
+    if(info->normal.x < 0) {
+        other_non_air <<= 1;
+        other_opaque <<= 1;
+    } else if(info->normal.x > 0) {
+        other_non_air >>= 1;
+        other_opaque >>= 1;
+    }
+
+    u32 non_air = masks->non_air[local_y + 1][z + 1];
+    u32 visible = non_air & ~other_opaque & ROW_INTERIOR_BITS;
+
+    // Transparent blocks next to transparent blocks of the same type merge into one volume
+    u32 both_transparent = visible & ~masks->opaque[local_y + 1][z + 1] & other_non_air;
+    while(both_transparent) {
+        i32 x = __builtin_ctz(both_transparent) - 1;
+        both_transparent &= both_transparent - 1;
+
+        i32 y = section * SECTION_SIZE + local_y;
+        u8 other = snapshot_get(snapshot, x + info->normal.x, y + info->normal.y, z + info->normal.z);
+        if(other == snapshot_get(snapshot, x, y, z)) {
+            visible &= ~(1u << (x + 1));
+        }
+    }
+    return visible;
+}
+
+// Merged face, positions are relative to the chunk
+typedef struct {
+    u8 type;
+    u8 direction;
+    u8 x, y, z;
+    u8 width, height;
+} FaceRect;
+
+// Merges the visible faces of one direction in a section into rectangles of the same block type
+// Returns the number of faces written
+static u32 merge_section_faces(
+    FaceRect *faces,
+    const ChunkSnapshot *snapshot,
+    i32 section,
+    i32 top,
+    const SectionMasks *masks,
+    FaceDirection direction) {
+    const FaceInfo *info = &face_infos[direction];
+
+    // Block type of the visible face at each slice and grid position, air for none
+    u8 grid[SECTION_SIZE][SECTION_SIZE * SECTION_SIZE];
+    u32 slices = 0;
+    u32 count = 0;
+    memset(grid, BLOCK_AIR, sizeof(grid));
+
+    for(i32 local_y = 0; local_y < top; local_y++) {
+        for(i32 z = 0; z < SECTION_SIZE; z++) {
+            u32 visible = visible_faces(snapshot, masks, section, local_y, z, direction);
+            while(visible) {
+                i32 x = __builtin_ctz(visible) - 1;
+                visible &= visible - 1;
+
+                i32 pos[3] = {x, local_y, z};
+                grid[pos[info->slice_axis]][pos[info->u_axis] + pos[info->v_axis] * SECTION_SIZE] =
+                    snapshot_get(snapshot, x, section * SECTION_SIZE + local_y, z);
+                slices |= 1u << pos[info->slice_axis];
+            }
+        }
+    }
+
+    while(slices) {
+        i32 slice = __builtin_ctz(slices);
+        slices &= slices - 1;
+        u8 *mask = grid[slice];
+
+        for(i32 v = 0; v < SECTION_SIZE; v++) {
+            for(i32 u = 0; u < SECTION_SIZE;) {
+                u8 type = mask[u + v * SECTION_SIZE];
+                if(type == BLOCK_AIR) {
+                    u++;
+                    continue;
+                }
+
+                i32 width = 1;
+                while(u + width < SECTION_SIZE && mask[u + width + v * SECTION_SIZE] == type) {
+                    width++;
+                }
+
+                // Grow downwards while the whole row matches
+                i32 height = 1;
+                while(v + height < SECTION_SIZE) {
+                    bool row_matches = true;
+                    for(i32 i = 0; i < width; i++) {
+                        if(mask[u + i + (v + height) * SECTION_SIZE] != type) {
+                            row_matches = false;
+                            break;
+                        }
+                    }
+                    if(!row_matches) {
+                        break;
+                    }
+                    height++;
+                }
+
+                for(i32 j = 0; j < height; j++) {
+                    memset(&mask[u + (v + j) * SECTION_SIZE], BLOCK_AIR, width);
                 }
+
+                i32 origin[3];
+                origin[info->slice_axis] = slice;
+                origin[info->u_axis] = u;
+                origin[info->v_axis] = v;
+                origin[1] += section * SECTION_SIZE;
+                faces[count++] = (FaceRect) {type, direction, origin[0], origin[1], origin[2], width, height};
+
+                u += width;
             }
         }
     }
+    return count;
+}
+
+// Jobs in flight at once, each holds a snapshot of its chunk
+#define MAX_MESH_JOBS 64
+
+typedef struct MeshJob {
+    struct MeshJob *next;
+    ivec2s pos;
+    u32 generation;
+    // Sections whose mesh is replaced, bit i for section i
+    u32 dirty;
+    // Dirty sections that can have faces, the others get an empty mesh
+    u32 sections;
+    // Only the dirty ones are built
+    MeshBuffer meshes[SECTION_COUNT];
+    ChunkSnapshot snapshot;
+} MeshJob;
+
+// Chunk waiting for its first mesh
+typedef struct MeshCandidate {
+    Chunk *chunk;
+    bool visible;
+    // Squared, from the camera to the middle of the chunk
+    f32 distance;
+} MeshCandidate;
+
+static bool section_full(const Chunk *chunk, i32 index) {
+    return chunk->sections[index].opaque_count == SECTION_VOLUME;
+}
+
+// A full section surrounded by full sections has no visible faces
+// Borders without a loaded neighbour get no faces either, the top of the world does
+// Below the world counts as opaque, so the bottom section only needs the one above it
+static bool section_buried(const Chunk *chunk, i32 index) {
+    if(index == SECTION_COUNT - 1 || !section_full(chunk, index)) {
+        return false;
+    }
+
+    if((index > 0 && !section_full(chunk, index - 1)) || !section_full(chunk, index + 1)) {
+        return false;
+    }
+
+    for(u32 i = 0; i < CHUNK_NEIGHBOUR_COUNT; i++) {
+        // Faces on chunk borders only need a non-air neighbour block
+        const Chunk *neighbour = chunk->neighbours[i];
+        if(neighbour && neighbour->sections[index].non_air_count != SECTION_VOLUME) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Sections that can have visible faces, bit i for section i
+static u32 sections_to_mesh(const Chunk *chunk) {
+    u32 sections = 0;
+    for(i32 i = 0; i < SECTION_COUNT; i++) {
+        if(chunk->sections[i].non_air_count != 0 && !section_buried(chunk, i)) {
+            sections |= 1u << i;
+        }
+    }
+    return sections;
+}
+
+// Merges all faces first so the buffer is allocated at its final size
+static void mesh_snapshot_section(MeshBuffer *mesh, const ChunkSnapshot *snapshot, i32 section) {
+    FaceRect faces[MAX_SECTION_FACES];
+    u32 face_count = 0;
+
+    // Rows at or above the chunk's height have no faces
+    i32 top = (i32) snapshot->height - section * SECTION_SIZE;
+    if(top > SECTION_SIZE) {
+        top = SECTION_SIZE;
+    }
+
+    SectionMasks masks;
+    build_section_masks(snapshot, section, top, &masks);
+    for(u32 direction = 0; direction < FACE_COUNT; direction++) {
+        face_count += merge_section_faces(&faces[face_count], snapshot, section, top, &masks, direction);
+    }
+
+    alloc_mesh_buffer(mesh, face_count);
+    for(u32 i = 0; i < face_count; i++) {
+        const FaceRect *face = &faces[i];
+        push_face(
+            mesh,
+            &blocks[face->type],
+            face->direction,
+            (ivec3s) {{face->x, face->y, face->z}},
+            (ivec2s) {{face->width, face->height}});
+    }
+}
+
+// Builds the dirty sections' meshes from the snapshot alone
+static void mesh_snapshot(MeshBuffer *meshes, const ChunkSnapshot *snapshot, u32 dirty, u32 sections) {
+    while(dirty) {
+        i32 section = __builtin_ctz(dirty);
+        dirty &= dirty - 1;
+
+        meshes[section] = (MeshBuffer) {0};
+        if(sections & (1u << section)) {
+            mesh_snapshot_section(&meshes[section], snapshot, section);
+        }
+    }
+}
+
+// Frees the meshes of the dirty sections
+static void free_mesh_buffers(MeshBuffer *meshes, u32 dirty) {
+    while(dirty) {
+        i32 section = __builtin_ctz(dirty);
+        dirty &= dirty - 1;
+        free_mesh_buffer(&meshes[section]);
+    }
+}
+
+// Swaps the dirty sections' new meshes in and frees the old ones
+static void swap_in_meshes(Chunk *chunk, MeshBuffer *meshes, u32 dirty) {
+    while(dirty) {
+        i32 section = __builtin_ctz(dirty);
+        dirty &= dirty - 1;
+
+        MeshBuffer *front = &chunk->mesh.front[section];
+        chunk->mesh.vertex_count += meshes[section].vertex_count - front->vertex_count;
+        free_mesh_buffer(front);
+        *front = meshes[section];
+    }
+    chunk->mesh.pending_sections = 0;
+}
+
+// Drops the chunk's queued mesh job, a running one finishes but its result is discarded
+static void drop_mesh_job(Chunk *chunk) {
+    if(chunk->mesh.job) {
+        cancel_tasks(get_thread_pool(), chunk->mesh.job);
+        chunk->mesh.job = NULL;
+    }
+    chunk->mesh.generation = 0;
+}
+
+// Frees the mesh, a running job's result is discarded
+static void clear_mesh(Chunk *chunk) {
+    drop_mesh_job(chunk);
+    free_mesh_buffers(chunk->mesh.front, ALL_SECTIONS);
+    chunk->mesh.vertex_count = 0;
+    chunk->mesh.pending_sections = 0;
+}
+
+void mesh_chunk(Chunk *chunk, bool update_flag) {
+    drop_mesh_job(chunk);
+
+    ChunkSnapshot snapshot;
+    take_snapshot(chunk, &snapshot, ALL_SECTIONS);
+
+    MeshBuffer meshes[SECTION_COUNT];
+    mesh_snapshot(meshes, &snapshot, ALL_SECTIONS, sections_to_mesh(chunk));
+    swap_in_meshes(chunk, meshes, ALL_SECTIONS);
 
     if(update_flag) {
         chunk->mesh.should_update = false;
     }
 }
 
-static void mesh_chunk_neighbours(Chunk *chunk) {
-    Chunk *left = get_chunk(chunk->pos.x - 1, chunk->pos.y);
-    Chunk *right = get_chunk(chunk->pos.x + 1, chunk->pos.y);
-    Chunk *back = get_chunk(chunk->pos.x, chunk->pos.y + 1);
-    Chunk *front = get_chunk(chunk->pos.x, chunk->pos.y - 1);
-    if(left) {
-        mesh_chunk(left, false);
+// Runs on a background worker, or on the main thread through cancel_tasks() if the job is dropped before it ran
+static void finish_mesh_job(void *arg) {
+    MeshJob *job = arg;
+    pthread_mutex_lock(&world.mesh_jobs.mutex);
+    job->next = world.mesh_jobs.finished;
+    world.mesh_jobs.finished = job;
+    pthread_mutex_unlock(&world.mesh_jobs.mutex);
+}
+
+static void run_mesh_job(void *arg) {
+    MeshJob *job = arg;
+    mesh_snapshot(job->meshes, &job->snapshot, job->dirty, job->sections);
+    finish_mesh_job(job);
+}
+
+// Takes a snapshot now and rebuilds the dirty sections on a background worker
+// An older job of the chunk is dropped, its sections are rebuilt by the new one
+static void queue_mesh(Chunk *chunk, u32 dirty) {
+    drop_mesh_job(chunk);
+    dirty |= chunk->mesh.pending_sections;
+
+    MeshJob *job = tracked_malloc(MEMORY_TAG_WORLD, sizeof(MeshJob));
+    job->pos = chunk->pos;
+    job->generation = ++world.mesh_jobs.last_generation;
+    job->dirty = dirty;
+    job->sections = dirty & sections_to_mesh(chunk);
+    // Freed as they are if the job is dropped before it runs
+    memset(job->meshes, 0, sizeof(job->meshes));
+    take_snapshot(chunk, &job->snapshot, job->sections);
+
+    chunk->mesh.job = job;
+    chunk->mesh.generation = job->generation;
+    chunk->mesh.pending_sections = dirty;
+    chunk->mesh.should_update = false;
+    world.mesh_jobs.in_flight++;
+    push_background_task(get_thread_pool(), run_mesh_job, finish_mesh_job, job, job);
+}
+
+// Replaces the drawn meshes of chunks whose latest job finished, never waits for running jobs
+// Dropped jobs carry an outdated generation, their meshes are freed
+static void swap_in_finished_meshes() {
+    pthread_mutex_lock(&world.mesh_jobs.mutex);
+    MeshJob *job = world.mesh_jobs.finished;
+    world.mesh_jobs.finished = NULL;
+    pthread_mutex_unlock(&world.mesh_jobs.mutex);
+
+    while(job) {
+        MeshJob *next = job->next;
+        Chunk *chunk = get_chunk(job->pos.x, job->pos.y);
+        if(chunk && chunk->mesh.job == job) {
+            chunk->mesh.job = NULL;
+        }
+
+        if(chunk && chunk->mesh.generation == job->generation) {
+            swap_in_meshes(chunk, job->meshes, job->dirty);
+        } else {
+            free_mesh_buffers(job->meshes, job->dirty);
+        }
+        tracked_free(job);
+        world.mesh_jobs.in_flight--;
+        job = next;
     }
-    if(right) {
-        mesh_chunk(right, false);
+}
+
+// Drops every mesh job and waits for the running ones
+static void drop_mesh_jobs() {
+    for(u32 i = 0; i < SQ(world.load_width); i++) {
+        drop_mesh_job(&world.chunks[i]);
     }
-    if(back) {
-        mesh_chunk(back, false);
+    thread_pool_wait_priority(get_thread_pool(), TASK_PRIORITY_BACKGROUND);
+    swap_in_finished_meshes();
+}
+
+// Remeshes the sections of a neighbour whose border faces depend on this chunk
+// Neighbours still waiting for their first mesh get it later anyway
+static void mesh_neighbour(Chunk *chunk, ChunkNeighbour side, u32 dirty) {
+    Chunk *neighbour = chunk->neighbours[side];
+    if(neighbour && !neighbour->mesh.should_update) {
+        queue_mesh(neighbour, dirty);
     }
-    if(front) {
-        mesh_chunk(front, false);
+}
+
+// Sections of the neighbour with blocks on the border facing this chunk, only those have faces that depend on it
+// 0 if the neighbour is missing or waiting for its first mesh anyway
+static u32 neighbour_border_sections(const Chunk *chunk, ChunkNeighbour side) {
+    const Chunk *neighbour = chunk->neighbours[side];
+    if(!neighbour || neighbour->mesh.should_update) {
+        return 0;
+    }
+
+    // Tallest column of the neighbour's border row
+    ivec2s offset = neighbour_offsets[side];
+    u8 height = 0;
+    for(u32 i = 0; i < SECTION_SIZE; i++) {
+        u8 column = offset.x != 0
+            ? neighbour->heightmap[i][offset.x < 0 ? CHUNK_WIDTH - 1 : 0]
+            : neighbour->heightmap[offset.y < 0 ? CHUNK_DEPTH - 1 : 0][i];
+        if(column > height) {
+            height = column;
+        }
+    }
+
+    u32 sections = 0;
+    for(i32 i = 0; i * SECTION_SIZE < height; i++) {
+        if(neighbour->sections[i].non_air_count != 0) {
+            sections |= 1u << i;
+        }
     }
+    return sections;
 }
 
 Block *chunk_get(Chunk *chunk, u8 x, u8 y, u8 z) {
     if(x >= CHUNK_WIDTH || y >= CHUNK_HEIGHT || z >= CHUNK_DEPTH) {
         return &blocks[BLOCK_AIR];
     }
-    return &blocks[chunk->blocks[x + (z * CHUNK_WIDTH) + (y * CHUNK_WIDTH * CHUNK_DEPTH)]];
+
+    const ChunkSection *section = &chunk->sections[y / SECTION_SIZE];
+    return &blocks[section_get(section, x + (z * CHUNK_WIDTH) + ((y % SECTION_SIZE) * CHUNK_WIDTH * CHUNK_DEPTH))];
+}
+
+// Heightmap value of the column counting only blocks below the given y, empty sections are skipped whole
+static u8 column_height(const Chunk *chunk, u8 x, u8 z, i32 below) {
+    for(i32 y = below - 1; y >= 0; y--) {
+        const ChunkSection *section = &chunk->sections[y / SECTION_SIZE];
+        if(section->non_air_count == 0) {
+            y -= y % SECTION_SIZE;
+            continue;
+        }
+
+        if(section_get(section, x + (z * CHUNK_WIDTH) + ((y % SECTION_SIZE) * CHUNK_WIDTH * CHUNK_DEPTH)) != BLOCK_AIR) {
+            return y + 1;
+        }
+    }
+    return 0;
+}
+
+static void update_chunk_height(Chunk *chunk) {
+    u8 height = 0;
+    for(u32 z = 0; z < CHUNK_DEPTH; z++) {
+        for(u32 x = 0; x < CHUNK_WIDTH; x++) {
+            if(chunk->heightmap[z][x] > height) {
+                height = chunk->heightmap[z][x];
+            }
+        }
+    }
+    chunk->height = height;
+}
+
+// For sections that were filled without chunk_set()
+static void build_heightmap(Chunk *chunk) {
+    for(u8 z = 0; z < CHUNK_DEPTH; z++) {
+        for(u8 x = 0; x < CHUNK_WIDTH; x++) {
+            chunk->heightmap[z][x] = column_height(chunk, x, z, CHUNK_HEIGHT);
+        }
+    }
+    update_chunk_height(chunk);
 }
 
 void chunk_set(Chunk *chunk, const Block *block, u8 x, u8 y, u8 z) {
@@ -619,7 +907,24 @@ void chunk_set(Chunk *chunk, const Block *block, u8 x, u8 y, u8 z) {
         return;
     }
 
-    chunk->blocks[x + (z * CHUNK_WIDTH) + (y * CHUNK_WIDTH * CHUNK_DEPTH)] = block->type;
+    ChunkSection *section = &chunk->sections[y / SECTION_SIZE];
+    section_set(section, x + (z * CHUNK_WIDTH) + ((y % SECTION_SIZE) * CHUNK_WIDTH * CHUNK_DEPTH), block->type);
+
+    u8 *column = &chunk->heightmap[z][x];
+    if(block->type != BLOCK_AIR) {
+        if(y >= *column) {
+            *column = y + 1;
+            if(*column > chunk->height) {
+                chunk->height = *column;
+            }
+        }
+    } else if(y + 1 == *column) {
+        // The top block of the column was removed
+        *column = column_height(chunk, x, z, y);
+        if(y + 1 == chunk->height) {
+            update_chunk_height(chunk);
+        }
+    }
 }
 
 static void world_set_unloaded(const Block *block, i32 x, i32 y, i32 z) {
@@ -629,12 +934,13 @@ static void world_set_unloaded(const Block *block, i32 x, i32 y, i32 z) {
     };
 
     if(!world.block_set_list.block_sets) {
-        world.block_set_list.block_sets = malloc(32 * sizeof(BlockSet));
+        world.block_set_list.block_sets = tracked_malloc(MEMORY_TAG_WORLD, 32 * sizeof(BlockSet));
         world.block_set_list.allocated = 32;
     }
 
     if(world.block_set_list.count >= world.block_set_list.allocated) {
-        world.block_set_list.block_sets = realloc(
+        world.block_set_list.block_sets = tracked_realloc(
+            MEMORY_TAG_WORLD,
             world.block_set_list.block_sets,
             2 * world.block_set_list.allocated * sizeof(BlockSet));
         world.block_set_list.allocated *= 2;
@@ -658,51 +964,122 @@ static void world_remove_block_set(u32 index) {
     world.block_set_list.count--;
 }
 
-static void store_chunk(const Chunk *chunk) {
-    if(!world.chunk_storage.chunks) {
-        world.chunk_storage.chunks = malloc(128 * sizeof(StoredChunk));
-        world.chunk_storage.allocated = 128;
+// Block sets for chunks that were never generated, saved with the world so trees spilling into them are not cut off
+#define BLOCK_SETS_FILE "block_sets"
+
+typedef struct {
+    i32 x, y, z;
+    u32 type;
+} SavedBlockSet;
+
+static void block_sets_path(const char *dir, char *path, u32 size) {
+    snprintf(path, size, "%s/" BLOCK_SETS_FILE, dir);
+}
+
+static void load_block_sets(const char *dir) {
+    char path[512];
+    block_sets_path(dir, path, sizeof(path));
+    FILE *file = fopen(path, "rb");
+    if(!file) {
+        return;
+    }
+
+    SavedBlockSet saved;
+    while(fread(&saved, sizeof(saved), 1, file) == 1) {
+        if(saved.type > MAX_BLOCK_ID || saved.y < 0 || saved.y >= CHUNK_HEIGHT) {
+            fprintf(stderr, "%s is corrupt, ignoring the rest\n", path);
+            break;
+        }
+        world_set_unloaded(&blocks[saved.type], saved.x, saved.y, saved.z);
+    }
+    fclose(file);
+}
+
+// Written next to the old file and renamed over it, so a crash keeps the previous block sets
+static void save_block_sets(const char *dir) {
+    char path[512];
+    char temp_path[520];
+    block_sets_path(dir, path, sizeof(path));
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+    FILE *file = fopen(temp_path, "wb");
+    bool ok = file != NULL;
+    for(u32 i = 0; i < world.block_set_list.count && ok; i++) {
+        const BlockSet *block_set = &world.block_set_list.block_sets[i];
+        SavedBlockSet saved = {block_set->pos.x, block_set->pos.y, block_set->pos.z, block_set->block->type};
+        ok = fwrite(&saved, sizeof(saved), 1, file) == 1;
+    }
+    if(file) {
+        ok = fclose(file) == 0 && ok;
     }
 
-    if(world.chunk_storage.count >= world.chunk_storage.allocated) {
-        world.chunk_storage.chunks = realloc(
-            world.chunk_storage.chunks,
-            2 * world.chunk_storage.allocated * sizeof(StoredChunk));
-        world.chunk_storage.allocated *= 2;
+    if(!ok || rename(temp_path, path) != 0) {
+        fprintf(stderr, "Failed to save %s\n", path);
+        remove(temp_path);
     }
-    
-    StoredChunk *ptr = &world.chunk_storage.chunks[world.chunk_storage.count];
-    ptr->pos = chunk->pos;
-    memcpy(ptr->blocks, chunk->blocks, sizeof(chunk->blocks));
-    world.chunk_storage.count++;
 }
 
-static void remove_stored_chunk(u32 index) {
-    if(index >= world.chunk_storage.count) {
+// Compresses the chunk into the cache, leaving the chunk empty
+static void store_chunk(Chunk *chunk) {
+    static u8 buffer[SERIALIZED_SECTIONS_BOUND(SECTION_COUNT)];
+
+    if(chunk->loading) {
+        // Nothing was read yet, the saved copy is still in the region files
+        chunk->loading = false;
         return;
     }
 
-    if(index < world.chunk_storage.allocated - 1) {
-        for(u32 i = index; i < world.chunk_storage.count - 1; i++) {
-            world.chunk_storage.chunks[i] = world.chunk_storage.chunks[i + 1];
-        }
+    u32 size = serialize_sections(chunk->sections, SECTION_COUNT, buffer);
+    chunk_cache_put(&world.chunk_cache, chunk->pos, buffer, size, chunk->saved);
+    clear_chunk_sections(chunk);
+}
+
+// Returns false if the stored data is corrupt
+static bool restore_chunk(Chunk *chunk, const u8 *data, u32 size, bool saved) {
+    clear_chunk_sections(chunk);
+    bool ok = deserialize_sections(data, size, chunk->sections, SECTION_COUNT);
+    chunk->saved = ok && saved;
+
+    if(!ok) {
+        fprintf(stderr, "Stored chunk %d, %d is corrupt, generating it again\n", chunk->pos.x, chunk->pos.y);
+        clear_chunk_sections(chunk);
+    } else {
+        build_heightmap(chunk);
     }
+    return ok;
+}
 
-    world.chunk_storage.count--;
+// Places blocks that were set while the chunk was not loaded
+static void apply_block_sets(Chunk *chunk) {
+    // Backwards iteration
+    if(world.block_set_list.count > 0) {
+        for(i32 i = world.block_set_list.count - 1; i >= 0; i--) {
+            BlockSet block_set = world.block_set_list.block_sets[i];
+
+            i32 chunk_pos_x = floorf(block_set.pos.x / 16.0f);
+            i32 chunk_pos_z = floorf(block_set.pos.z / 16.0f);
+
+            if(chunk_pos_x == chunk->pos.x
+                && chunk_pos_z == chunk->pos.y) {
+                i32 chunk_x = MOD(block_set.pos.x, CHUNK_WIDTH);
+                i32 chunk_z = MOD(block_set.pos.z, CHUNK_DEPTH);
+
+                chunk->saved = false;
+                chunk_set(chunk, block_set.block, chunk_x, block_set.pos.y, chunk_z);
+                world_remove_block_set(i);
+            }
+        }
+    }
 }
 
 static void gen_chunk(Chunk *chunk) {
     ivec3s tree_positions[CHUNK_WIDTH * CHUNK_HEIGHT];
     u32 tree_count = 0;
 
-    for(i32 i = world.chunk_storage.count - 1; i >= 0; i--) {
-        StoredChunk *c = &world.chunk_storage.chunks[i];
-        if(c->pos.x == chunk->pos.x && c->pos.y == chunk->pos.y) {
-            memcpy(chunk->blocks, c->blocks, sizeof(chunk->blocks));
-            remove_stored_chunk(i);
-            return;
-        }
-    }
+    chunk->saved = false;
+
+    // Seeded by position so a chunk dropped from the cache comes back with the same trees
+    set_xorshift32_seed((((u32) chunk->pos.x * 73856093u) ^ ((u32) chunk->pos.y * 19349663u)) | 1);
 
     for(u8 x = 0; x < CHUNK_WIDTH; x++) {
         for(u8 z = 0; z < CHUNK_DEPTH; z++) {
@@ -753,120 +1130,426 @@ static void gen_chunk(Chunk *chunk) {
         }
     }
 
-    // Backwards iteration
-    if(world.block_set_list.count > 0) {
-        for(i32 i = world.block_set_list.count - 1; i >= 0; i--) {
-            BlockSet block_set = world.block_set_list.block_sets[i];
+    apply_block_sets(chunk);
 
-            i32 chunk_pos_x = floorf(block_set.pos.x / 16.0f);
-            i32 chunk_pos_z = floorf(block_set.pos.z / 16.0f);
+    // Generation grows the palettes one block at a time, shrink them to what is left
+    for(u32 i = 0; i < SECTION_COUNT; i++) {
+        compact_section(&chunk->sections[i]);
+    }
+}
 
-            if(chunk_pos_x == chunk->pos.x
-                && chunk_pos_z == chunk->pos.y) {
-                i32 chunk_x = MOD(block_set.pos.x, CHUNK_WIDTH);
-                i32 chunk_z = MOD(block_set.pos.z, CHUNK_DEPTH);
+// Restores the chunk from its stored copy, generates it if there is none
+static void fill_chunk(Chunk *chunk, const u8 *data, u32 size, bool saved) {
+    if(data && restore_chunk(chunk, data, size, saved)) {
+        apply_block_sets(chunk);
+    } else {
+        gen_chunk(chunk);
+    }
+}
 
-                chunk_set(chunk, block_set.block, chunk_x, block_set.pos.y, chunk_z);
-                world_remove_block_set(i);
-            }
-        }
+static u32 chunk_slot(i32 x, i32 y) {
+    i32 width = world.load_width;
+    return MOD(x, width) + MOD(y, width) * width;
+}
+
+static u32 clamp_distance(u32 distance) {
+    if(distance < 1) {
+        return 1;
     }
+    return distance > MAX_LOAD_DISTANCE ? MAX_LOAD_DISTANCE : distance;
 }
 
-World *init_world() {
-    world.chunks = calloc(SQ(LOAD_WIDTH), sizeof(Chunk*));
+World *init_world(u32 load_distance, u32 view_distance, u64 cache_budget, const char *world_dir) {
+    world.load_distance = clamp_distance(load_distance);
+    world.load_width = world.load_distance * 2 + 1;
+    world.chunks = tracked_calloc(MEMORY_TAG_WORLD, SQ(world.load_width), sizeof(Chunk));
     world.chunk_count = 0;
+    world.has_center = false;
+    world.complete_radius = 0;
+    set_view_distance(view_distance);
 
     world.block_set_list.block_sets = NULL;
     world.block_set_list.count = 0;
 
-    set_xorshift32_seed(1);
+    pthread_mutex_init(&world.mesh_jobs.mutex, NULL);
+    world.mesh_jobs.finished = NULL;
+    world.mesh_jobs.in_flight = 0;
+    world.mesh_jobs.last_generation = 0;
+    world.mesh_jobs.queue = tracked_malloc(MEMORY_TAG_WORLD, SQ(world.load_width) * sizeof(MeshCandidate));
+
+    world.persistent = world_dir && init_chunk_io(&world.chunk_io, world_dir);
+    if(world.persistent) {
+        load_block_sets(world_dir);
+    }
+    init_chunk_cache(&world.chunk_cache, cache_budget, world.persistent ? &world.chunk_io : NULL);
 
     return &world;
 }
 
 Chunk *get_chunk(i32 x, i32 y) {
-    for(u32 i = 0; i < world.chunk_count; i++) {
-        Chunk *chunk = world.chunks[i];
-        if(chunk->pos.x == x && chunk->pos.y == y) {
-            return chunk;
-        }
+    Chunk *chunk = &world.chunks[chunk_slot(x, y)];
+    if(chunk->loaded && chunk->pos.x == x && chunk->pos.y == y) {
+        return chunk;
     }
     return NULL;
 }
 
-static Chunk *add_chunk(i32 x, i32 y) {
-    Chunk *chunk = calloc(1, sizeof(Chunk));
+static void link_chunk_neighbours(Chunk *chunk) {
+    for(u32 i = 0; i < CHUNK_NEIGHBOUR_COUNT; i++) {
+        Chunk *neighbour = get_chunk(chunk->pos.x + neighbour_offsets[i].x, chunk->pos.y + neighbour_offsets[i].y);
+        chunk->neighbours[i] = neighbour;
+        if(neighbour) {
+            neighbour->neighbours[OPPOSITE_NEIGHBOUR(i)] = chunk;
+        }
+    }
+}
+
+static void unlink_chunk_neighbours(Chunk *chunk) {
+    for(u32 i = 0; i < CHUNK_NEIGHBOUR_COUNT; i++) {
+        if(chunk->neighbours[i]) {
+            chunk->neighbours[i]->neighbours[OPPOSITE_NEIGHBOUR(i)] = NULL;
+            chunk->neighbours[i] = NULL;
+        }
+    }
+}
+
+// Chebyshev distance, the loaded area is a square
+static u32 chunk_distance(ivec2s a, ivec2s b) {
+    u32 dx = abs(a.x - b.x);
+    u32 dy = abs(a.y - b.y);
+    return dx > dy ? dx : dy;
+}
+
+static bool in_load_range(ivec2s pos, ivec2s center) {
+    return chunk_distance(pos, center) <= world.load_distance;
+}
+
+// Stores the chunk and frees its slot
+static void unload_chunk(Chunk *chunk) {
+    store_chunk(chunk);
+    unlink_chunk_neighbours(chunk);
+    clear_chunk_sections(chunk);
+    clear_mesh(chunk);
+    chunk->loaded = false;
+    world.chunk_count--;
+}
+
+static void load_chunk(Chunk *chunk, i32 x, i32 y) {
     chunk->pos = (ivec2s) {x, y};
+    chunk->loaded = true;
+    clear_mesh(chunk);
     chunk->mesh.should_update = true;
-    chunk->mesh.being_rendered = false;
-    world.chunks[world.chunk_count] = chunk;
+    clear_chunk_sections(chunk);
     world.chunk_count++;
-    return chunk;
+    link_chunk_neighbours(chunk);
+
+    CachedChunk *stored = chunk_cache_take(&world.chunk_cache, chunk->pos);
+    if(stored) {
+        fill_chunk(chunk, stored->data, stored->size, stored->saved);
+        tracked_free(stored);
+    } else if(world.persistent) {
+        // Filled in by receive_loaded_chunks()
+        chunk->loading = true;
+        chunk_io_load(&world.chunk_io, chunk->pos);
+    } else {
+        gen_chunk(chunk);
+    }
 }
 
-void update_world() {
-    load_chunks();
-    for(u32 i = 0; i < world.chunk_count; i++) {
-        Chunk *chunk = world.chunks[i];
-        if(chunk->mesh.should_update) {
-            mesh_chunk(chunk, true);
-            mesh_chunk_neighbours(chunk);
-            return;
+// Calls func for every chunk position that is in range of center but was not in range of the old center
+// Only the rows and columns that scrolled in are visited
+static void for_each_new_position(ivec2s center, void (*func)(ivec2s center, i32 x, i32 y)) {
+    i32 distance = world.load_distance;
+    ivec2s old_center = world.center;
+    bool full = !world.has_center || chunk_distance(center, old_center) >= world.load_width;
+
+    for(i32 x = center.x - distance; x <= center.x + distance; x++) {
+        bool new_column = full || abs(x - old_center.x) > distance;
+        if(new_column) {
+            for(i32 y = center.y - distance; y <= center.y + distance; y++) {
+                func(center, x, y);
+            }
+        }
+    }
+
+    if(full) {
+        return;
+    }
+
+    for(i32 y = center.y - distance; y <= center.y + distance; y++) {
+        if(abs(y - old_center.y) > distance) {
+            for(i32 x = center.x - distance; x <= center.x + distance; x++) {
+                // Corner positions were already visited by the column pass
+                if(abs(x - old_center.x) <= distance) {
+                    func(center, x, y);
+                }
+            }
         }
     }
 }
 
+static void unload_scrolled_out(ivec2s center, i32 x, i32 y) {
+    Chunk *chunk = &world.chunks[chunk_slot(x, y)];
+    if(chunk->loaded && !in_load_range(chunk->pos, center)) {
+        unload_chunk(chunk);
+    }
+}
+
+// Unloads the chunks that left the loaded square, generation happens in update_world()
 void load_chunks() {
-    i32 chunk_pos_x = floorf(player.pos.x / CHUNK_WIDTH);
-    i32 chunk_pos_z = floorf(player.pos.z / CHUNK_DEPTH);
-
-    // Indices of chunks to remove
-    i32 chunks_to_remove[SQ(LOAD_WIDTH)];
-    i32 a = 0;
-
-    for(i32 i = 0; i < SQ(LOAD_WIDTH); i++) {
-        Chunk *chunk = world.chunks[i];
-        if(chunk) {
-            if(fabsf(chunk->pos.x - chunk_pos_x) > LOAD_DISTANCE) {
-                chunks_to_remove[a] = i;
-                a++;
-            } else if(fabsf(chunk->pos.y - chunk_pos_z) > LOAD_DISTANCE) {
-                chunks_to_remove[a] = i;
-                a++;
-            }
+    ivec2s center = (ivec2s) {
+        floorf(player.pos.x / CHUNK_WIDTH),
+        floorf(player.pos.z / CHUNK_DEPTH)
+    };
+
+    if(world.has_center && center.x == world.center.x && center.y == world.center.y) {
+        return;
+    }
+
+    if(world.has_center) {
+        // Rings closer than complete_radius around the old center still cover the new rings this far out
+        u32 moved = chunk_distance(center, world.center);
+        world.complete_radius = world.complete_radius > moved ? world.complete_radius - moved : 0;
+    }
+
+    for_each_new_position(center, unload_scrolled_out);
+
+    world.center = center;
+    world.has_center = true;
+}
+
+typedef struct {
+    u64 deadline;
+    u32 done;
+} ChunkBudget;
+
+static bool has_time(const ChunkBudget *budget) {
+    // At least one chunk per pass so loading never stalls
+    return budget->done == 0 || ns_now() < budget->deadline;
+}
+
+typedef bool (*chunk_position_func)(i32 x, i32 y, ChunkBudget *budget);
+
+// Calls func for each position of the square ring at distance radius around center until it returns false
+static bool for_each_ring_position(ivec2s center, i32 radius, chunk_position_func func, ChunkBudget *budget) {
+    if(radius == 0) {
+        return func(center.x, center.y, budget);
+    }
+
+    for(i32 x = center.x - radius; x <= center.x + radius; x++) {
+        if(!func(x, center.y - radius, budget) || !func(x, center.y + radius, budget)) {
+            return false;
         }
     }
+    for(i32 y = center.y - radius + 1; y <= center.y + radius - 1; y++) {
+        if(!func(center.x - radius, y, budget) || !func(center.x + radius, y, budget)) {
+            return false;
+        }
+    }
+    return true;
+}
 
-    if(a > 0) {
-        for(i32 i = a - 1; i >= 0; i--) {
-            Chunk *chunk = world.chunks[chunks_to_remove[i]];
-            i32 index = chunks_to_remove[i];
-            if(chunk) {
-                store_chunk(chunk);
-                destroy_chunk(chunk);
-                free(chunk);
-                world.chunks[index] = NULL;
-                if(index < SQ(LOAD_WIDTH) - 1) {
-                    for(i32 j = index; j < SQ(LOAD_WIDTH) - 1; j++) {
-                        world.chunks[j] = world.chunks[j + 1];
-                    }
-                    world.chunks[world.chunk_count - 1] = NULL;
-                }
-                world.chunk_count--;
-            }
+static bool generate_at(i32 x, i32 y, ChunkBudget *budget) {
+    Chunk *chunk = &world.chunks[chunk_slot(x, y)];
+    if(chunk->loaded) {
+        return true;
+    }
+
+    if(!has_time(budget) || (world.persistent && !chunk_io_can_load(&world.chunk_io))) {
+        return false;
+    }
+
+    load_chunk(chunk, x, y);
+    budget->done++;
+    return true;
+}
+
+// A chunk is only meshed once the loaded neighbours it borders have blocks, its border faces depend on them
+static bool neighbours_ready(const Chunk *chunk) {
+    for(u32 i = 0; i < CHUNK_NEIGHBOUR_COUNT; i++) {
+        ivec2s pos = (ivec2s) {chunk->pos.x + neighbour_offsets[i].x, chunk->pos.y + neighbour_offsets[i].y};
+        const Chunk *neighbour = chunk->neighbours[i];
+        if((!neighbour || neighbour->loading) && in_load_range(pos, world.center)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool chunk_in_frustum(const Chunk *chunk, vec4s frustum_planes[6]) {
+    vec3s box[2] = {
+        (vec3s) {chunk->pos.x * CHUNK_WIDTH, 0, chunk->pos.y * CHUNK_DEPTH},
+        (vec3s) {(chunk->pos.x + 1) * CHUNK_WIDTH, chunk->height, (chunk->pos.y + 1) * CHUNK_DEPTH}
+    };
+    return glms_aabb_frustum(box, frustum_planes);
+}
+
+// Visible chunks first, nearest first within each group
+static int compare_mesh_candidates(const void *a, const void *b) {
+    const MeshCandidate *candidate_a = a;
+    const MeshCandidate *candidate_b = b;
+    if(candidate_a->visible != candidate_b->visible) {
+        return candidate_a->visible ? -1 : 1;
+    }
+    return candidate_a->distance < candidate_b->distance ? -1 : (candidate_a->distance > candidate_b->distance);
+}
+
+// Queues the waiting chunks in the order the player needs them, not in slot order
+static void queue_waiting_meshes(ChunkBudget *budget) {
+    if(world.mesh_jobs.in_flight >= MAX_MESH_JOBS) {
+        return;
+    }
+
+    vec4s frustum_planes[6];
+    glms_frustum_planes(glms_mat4_mul(player.camera.proj, player.camera.view), frustum_planes);
+
+    u32 count = 0;
+    for(u32 i = 0; i < SQ(world.load_width); i++) {
+        Chunk *chunk = &world.chunks[i];
+        if(!chunk->loaded || chunk->loading || !chunk->mesh.should_update || !neighbours_ready(chunk)) {
+            continue;
         }
+
+        vec2s middle = (vec2s) {(chunk->pos.x + 0.5f) * CHUNK_WIDTH, (chunk->pos.y + 0.5f) * CHUNK_DEPTH};
+        world.mesh_jobs.queue[count++] = (MeshCandidate) {
+            chunk,
+            chunk_in_frustum(chunk, frustum_planes),
+            SQ(middle.x - player.camera.pos.x) + SQ(middle.y - player.camera.pos.z)
+        };
     }
+    qsort(world.mesh_jobs.queue, count, sizeof(MeshCandidate), compare_mesh_candidates);
+
+    // Background workers start jobs in the order they are pushed
+    for(u32 i = 0; i < count && has_time(budget); i++) {
+        Chunk *chunk = world.mesh_jobs.queue[i].chunk;
+
+        // The neighbours' border faces were built without this chunk, their jobs count against the cap too
+        u32 neighbour_sections[CHUNK_NEIGHBOUR_COUNT];
+        u32 jobs = 1;
+        for(u32 j = 0; j < CHUNK_NEIGHBOUR_COUNT; j++) {
+            neighbour_sections[j] = neighbour_border_sections(chunk, j);
+            jobs += neighbour_sections[j] != 0;
+        }
+        if(world.mesh_jobs.in_flight + jobs > MAX_MESH_JOBS) {
+            break;
+        }
 
-    for(i32 x = -LOAD_DISTANCE; x <= LOAD_DISTANCE; x++) {
-        for(i32 z = -LOAD_DISTANCE; z <= LOAD_DISTANCE; z++) {
-            Chunk *chunk = get_chunk(x + chunk_pos_x, z + chunk_pos_z);
-            if(!chunk) {
-                Chunk *new_chunk = add_chunk(x + chunk_pos_x, z + chunk_pos_z);
-                gen_chunk(new_chunk);
+        queue_mesh(chunk, ALL_SECTIONS);
+        for(u32 j = 0; j < CHUNK_NEIGHBOUR_COUNT; j++) {
+            if(neighbour_sections[j]) {
+                queue_mesh(chunk->neighbours[j], neighbour_sections[j]);
             }
         }
+        budget->done++;
+    }
+}
+
+// Fills the chunks the I/O thread finished reading, chunks unloaded in the meantime go to the cache
+static void receive_loaded_chunks(ChunkBudget *budget) {
+    ChunkIOMessage completion;
+    while(has_time(budget) && chunk_io_poll(&world.chunk_io, &completion)) {
+        Chunk *chunk = get_chunk(completion.pos.x, completion.pos.y);
+        if(chunk && chunk->loading) {
+            chunk->loading = false;
+            chunk->mesh.should_update = true;
+            fill_chunk(chunk, completion.data, completion.size, completion.saved);
+            budget->done++;
+        } else if(completion.data) {
+            chunk_cache_put(&world.chunk_cache, completion.pos, completion.data, completion.size, completion.saved);
+        }
+        chunk_io_release(&world.chunk_io, &completion);
+    }
+}
+
+void update_world(u64 budget_ns) {
+    u64 deadline = ns_now() + budget_ns;
+    load_chunks();
+
+    swap_in_finished_meshes();
+
+    ChunkBudget budget = {.deadline = deadline};
+    if(world.persistent) {
+        receive_loaded_chunks(&budget);
+    }
+    // Nearest first
+    for(u32 radius = world.complete_radius; radius <= world.load_distance; radius++) {
+        if(!for_each_ring_position(world.center, radius, generate_at, &budget)) {
+            break;
+        }
+        world.complete_radius = radius + 1;
+    }
+
+    budget = (ChunkBudget) {.deadline = deadline};
+    queue_waiting_meshes(&budget);
+}
+
+void set_load_distance(u32 load_distance) {
+    load_distance = clamp_distance(load_distance);
+    if(load_distance == world.load_distance) {
+        return;
+    }
+
+    Chunk *old_chunks = world.chunks;
+    u32 old_width = world.load_width;
+    bool view_follows = world.view_distance == world.load_distance;
+
+    world.load_distance = load_distance;
+    world.load_width = load_distance * 2 + 1;
+    world.chunks = tracked_calloc(MEMORY_TAG_WORLD, SQ(world.load_width), sizeof(Chunk));
+    world.chunk_count = 0;
+    world.complete_radius = 0;
+    tracked_free(world.mesh_jobs.queue);
+    world.mesh_jobs.queue = tracked_malloc(MEMORY_TAG_WORLD, SQ(world.load_width) * sizeof(MeshCandidate));
+
+    // Chunks still in range move to their slot in the new torus, their mesh buffers move with them
+    for(u32 i = 0; i < SQ(old_width); i++) {
+        Chunk *chunk = &old_chunks[i];
+        if(chunk->loaded && in_load_range(chunk->pos, world.center)) {
+            world.chunks[chunk_slot(chunk->pos.x, chunk->pos.y)] = *chunk;
+            world.chunk_count++;
+            continue;
+        }
+
+        if(chunk->loaded) {
+            drop_mesh_job(chunk);
+            store_chunk(chunk);
+        }
+        destroy_chunk(chunk);
+    }
+    tracked_free(old_chunks);
+
+    // Chunks moved, so every neighbour pointer is stale
+    for(u32 i = 0; i < SQ(world.load_width); i++) {
+        Chunk *chunk = &world.chunks[i];
+        if(chunk->loaded) {
+            link_chunk_neighbours(chunk);
+        }
+    }
+
+    set_view_distance(view_follows ? load_distance : world.view_distance);
+}
+
+void set_view_distance(u32 view_distance) {
+    view_distance = clamp_distance(view_distance);
+    world.view_distance = view_distance > world.load_distance ? world.load_distance : view_distance;
+}
+
+f32 view_far_plane() {
+    // Farthest corner of the visible square seen from anywhere in the center chunk, up to the top of the world
+    f32 horizontal = (world.view_distance + 1) * CHUNK_WIDTH * sqrtf(2.0f);
+    return sqrtf(SQ(horizontal) + SQ(CHUNK_HEIGHT));
+}
+
+bool chunk_visible(const Chunk *chunk, vec4s frustum_planes[6]) {
+    if(!chunk->loaded || chunk->mesh.vertex_count == 0) {
+        return false;
+    }
+
+    if(chunk_distance(chunk->pos, world.center) > world.view_distance) {
+        return false;
     }
+
+    return chunk_in_frustum(chunk, frustum_planes);
 }
 
 void world_set(const Block *block, i32 x, i32 y, i32 z) {
@@ -874,7 +1557,7 @@ void world_set(const Block *block, i32 x, i32 y, i32 z) {
     i32 chunk_pos_z = floorf(z / 16.0f);
 
     Chunk *chunk = get_chunk(chunk_pos_x, chunk_pos_z);
-    if(!chunk) {
+    if(!chunk || chunk->loading) {
         // Saved to an arraylist, will be used when the chunk is loaded
         world_set_unloaded(block, x, y, z);
         return;
@@ -883,6 +1566,7 @@ void world_set(const Block *block, i32 x, i32 y, i32 z) {
     i32 chunk_x = MOD(x, CHUNK_WIDTH);
     i32 chunk_z = MOD(z, CHUNK_DEPTH);
 
+    chunk->saved = false;
     chunk_set(chunk, block, chunk_x, y, chunk_z);
 }
 
@@ -893,12 +1577,34 @@ void world_set_and_mesh(const Block *block, i32 x, i32 y, i32 z) {
     i32 chunk_pos_z = floorf(z / 16.0f);
 
     Chunk *chunk = get_chunk(chunk_pos_x, chunk_pos_z);
-    if(!chunk) {
+    // Chunks without a mesh yet get a full one, along with their neighbours
+    if(!chunk || chunk->loading || chunk->mesh.should_update || y < 0 || y >= CHUNK_HEIGHT) {
         return;
     }
 
-    mesh_chunk(chunk, true);
-    mesh_chunk_neighbours(chunk);
+    // Only the block's section changes, and the sections and neighbours it touches
+    i32 section = y / SECTION_SIZE;
+    u32 dirty = 1u << section;
+    if(y % SECTION_SIZE == 0 && section > 0) {
+        dirty |= 1u << (section - 1);
+    }
+    if(y % SECTION_SIZE == SECTION_SIZE - 1 && section < SECTION_COUNT - 1) {
+        dirty |= 1u << (section + 1);
+    }
+    queue_mesh(chunk, dirty);
+
+    i32 chunk_x = MOD(x, CHUNK_WIDTH);
+    i32 chunk_z = MOD(z, CHUNK_DEPTH);
+    if(chunk_x == 0) {
+        mesh_neighbour(chunk, CHUNK_NEIGHBOUR_NEG_X, dirty);
+    } else if(chunk_x == CHUNK_WIDTH - 1) {
+        mesh_neighbour(chunk, CHUNK_NEIGHBOUR_POS_X, dirty);
+    }
+    if(chunk_z == 0) {
+        mesh_neighbour(chunk, CHUNK_NEIGHBOUR_NEG_Z, dirty);
+    } else if(chunk_z == CHUNK_DEPTH - 1) {
+        mesh_neighbour(chunk, CHUNK_NEIGHBOUR_POS_Z, dirty);
+    }
 }
 
 Block *world_get(i32 x, i32 y, i32 z) {
@@ -916,12 +1622,78 @@ Block *world_get(i32 x, i32 y, i32 z) {
     return chunk_get(chunk, chunk_x, y, chunk_z);
 }
 
+void init_block_accessor(BlockAccessor *accessor) {
+    accessor->chunk = NULL;
+}
+
+Block *accessor_get(BlockAccessor *accessor, i32 x, i32 y, i32 z) {
+    i32 chunk_pos_x = floorf(x / 16.0f);
+    i32 chunk_pos_z = floorf(z / 16.0f);
+
+    Chunk *chunk = accessor->chunk;
+    // The cached chunk's slot may have been reused since the last read
+    if(!chunk || !chunk->loaded || chunk->pos.x != chunk_pos_x || chunk->pos.y != chunk_pos_z) {
+        chunk = NULL;
+        if(accessor->chunk && accessor->chunk->loaded) {
+            // Stepping into a neighbouring chunk is the common case
+            Chunk *previous = accessor->chunk;
+            for(u32 i = 0; i < CHUNK_NEIGHBOUR_COUNT; i++) {
+                if(previous->pos.x + neighbour_offsets[i].x == chunk_pos_x
+                    && previous->pos.y + neighbour_offsets[i].y == chunk_pos_z) {
+                    chunk = previous->neighbours[i];
+                    break;
+                }
+            }
+        }
+
+        if(!chunk) {
+            chunk = get_chunk(chunk_pos_x, chunk_pos_z);
+        }
+        if(!chunk) {
+            return NULL;
+        }
+        accessor->chunk = chunk;
+    }
+
+    i32 chunk_x = MOD(x, CHUNK_WIDTH);
+    i32 chunk_z = MOD(z, CHUNK_DEPTH);
+
+    return chunk_get(chunk, chunk_x, y, chunk_z);
+}
+
 void destroy_world() {
-    for(i32 i = 0; i < SQ(LOAD_WIDTH); i++) {
-        Chunk *chunk = world.chunks[i];
-        if(chunk) {
-            destroy_chunk(chunk);
-            free(chunk);
+    drop_mesh_jobs();
+    pthread_mutex_destroy(&world.mesh_jobs.mutex);
+
+    if(world.persistent) {
+        for(u32 i = 0; i < SQ(world.load_width); i++) {
+            if(world.chunks[i].loaded) {
+                store_chunk(&world.chunks[i]);
+                world.chunks[i].loaded = false;
+            }
         }
+
+        // Loads still in flight may carry saves the I/O thread had not written yet
+        while(world.chunk_io.loads_in_flight > 0) {
+            ChunkBudget budget = {0};
+            receive_loaded_chunks(&budget);
+            sleep_microseconds(100);
+        }
+        flush_chunk_cache(&world.chunk_cache);
+        // Block sets still pending wait for chunks that are not loaded, often ones that were never generated
+        save_block_sets(world.chunk_io.store.dir);
+        destroy_chunk_io(&world.chunk_io);
+    }
+
+    for(u32 i = 0; i < SQ(world.load_width); i++) {
+        destroy_chunk(&world.chunks[i]);
     }
+
+    tracked_free(world.chunks);
+    tracked_free(world.mesh_jobs.queue);
+
+    tracked_free(world.block_set_list.block_sets);
+    destroy_chunk_cache(&world.chunk_cache);
+    destroy_section_buffers();
+    destroy_mesh_buffers();
 }
\ No newline at end of file
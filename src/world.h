@@ -2,6 +2,9 @@
 #define _WORLD_H
 
 #include "rendering.h"
+#include "section.h"
+#include "chunk_cache.h"
+#include "chunk_io.h"
 
 #include <pthread.h>
 
@@ -9,9 +12,12 @@
 #define CHUNK_HEIGHT 128
 #define CHUNK_DEPTH 16
 
-#define LOAD_DISTANCE 1
-// Side width of the square of loaded chunks
-#define LOAD_WIDTH (LOAD_DISTANCE * 2 + 1)
+// Chunks are split vertically into cubic sections
+#define SECTION_COUNT (CHUNK_HEIGHT / SECTION_SIZE)
+
+// In chunks from the player's chunk, the loaded area is a square of side 2 * distance + 1
+#define DEFAULT_LOAD_DISTANCE 1
+#define MAX_LOAD_DISTANCE 64
 
 typedef enum {
     BLOCK_AIR = 0,
@@ -28,6 +34,10 @@ typedef enum {
 
 #define MAX_BLOCK_ID 0x000000FF
 
+// The block texture atlas has 8x8 tiles
+#define ATLAS_TILES_PER_ROW 8
+#define ATLAS_TILE_SIZE (1.0f / ATLAS_TILES_PER_ROW)
+
 typedef struct {
     BlockType type;
 
@@ -41,67 +51,142 @@ typedef struct {
 
 extern Block blocks[MAX_BLOCK_ID + 1];
 
-typedef struct {
-    vec3s pos;
-} BlockFace;
-
 typedef struct {
     ivec3s pos;
     const Block *block;
 } BlockSet;
 
+typedef enum {
+    CHUNK_NEIGHBOUR_NEG_X = 0,
+    CHUNK_NEIGHBOUR_POS_X = 1,
+    CHUNK_NEIGHBOUR_NEG_Z = 2,
+    CHUNK_NEIGHBOUR_POS_Z = 3,
+    CHUNK_NEIGHBOUR_COUNT
+} ChunkNeighbour;
+
+// Vertex array, 4 vertices per quad, see draw_packed_quads()
+// Positions are relative to the chunk
 typedef struct {
+    PackedVertex *vertices;
+    u32 vertex_count;
+    // Rounded up to the buffer's size class
+    u32 vertex_count_alloc;
+} MeshBuffer;
+
+struct MeshJob;
+
+typedef struct Chunk {
     ivec2s pos;
+    // Slots of the loaded grid are reused, unloaded slots hold no chunk
+    bool loaded;
+    // Unchanged since it was read from the region files
+    bool saved;
+    // Waiting for the I/O thread, has no blocks until then
+    bool loading;
+
+    // Loaded neighbours, NULL if not loaded, updated on load and unload
+    struct Chunk *neighbours[CHUNK_NEIGHBOUR_COUNT];
 
+    // One mesh per section, so an edit only rebuilds the sections it touches
     struct {
-        Vertex *vertices;
-        BlockFace *faces;
+        // Drawn meshes, only replaced on the main thread between frames
+        MeshBuffer front[SECTION_COUNT];
+        // Sum over the drawn meshes
         u32 vertex_count;
-        u32 vertex_count_alloc;
+        // Queued or running mesh job, NULL if none
+        struct MeshJob *job;
+        // Id of the latest mesh job, results of older jobs are dropped
+        u32 generation;
+        // Sections the latest job rebuilds, bit i for section i, cleared once its meshes are swapped in
+        u32 pending_sections;
         bool should_update;
-        bool being_rendered;
     } mesh;
 
-    u8 blocks[CHUNK_WIDTH * CHUNK_HEIGHT * CHUNK_DEPTH];
+    ChunkSection sections[SECTION_COUNT];
+    // One above the highest non-air block of each column, 0 for an empty column, kept up to date by chunk_set()
+    u8 heightmap[CHUNK_DEPTH][CHUNK_WIDTH];
+    // Highest column, nothing at or above it is meshed
+    u8 height;
 } Chunk;
 
+// Cursor for world coordinate reads, remembers the last chunk so nearby reads skip the chunk lookup
 typedef struct {
-    ivec2s pos;
-    u8 blocks[CHUNK_WIDTH * CHUNK_HEIGHT * CHUNK_DEPTH];
-} StoredChunk;
+    Chunk *chunk;
+} BlockAccessor;
 
 typedef struct {
-    Chunk **chunks;
+    // load_width x load_width torus, a chunk lives in slot (x mod load_width, y mod load_width)
+    // Loaded chunks always fit in a load_width x load_width square, so no two share a slot
+    Chunk *chunks;
     u32 chunk_count;
 
+    u32 load_distance;
+    u32 load_width;
+    // Chunks further than this are not drawn, at most load_distance
+    u32 view_distance;
+
+    // Chunk the loaded square is centered on
+    ivec2s center;
+    bool has_center;
+    // Every ring around center closer than this is generated
+    u32 complete_radius;
+
     struct {
         BlockSet *block_sets;
         u32 count;
         u32 allocated;
     } block_set_list;
 
-    // Local chunk storage for unloaded chunks
+    // Mesh jobs run on the background workers, update_world() swaps in the finished ones
     struct {
-        StoredChunk *chunks;
-        u32 count;
-        u32 allocated;
-    } chunk_storage;
+        pthread_mutex_t mutex;
+        // Finished and cancelled jobs, guarded by the mutex
+        struct MeshJob *finished;
+        // Main thread only
+        u32 in_flight;
+        u32 last_generation;
+        // Chunks waiting for their first mesh, sorted every update, one entry per slot
+        struct MeshCandidate *queue;
+    } mesh_jobs;
+
+    // Unloaded chunks, compressed
+    ChunkCache chunk_cache;
+    // Only used if the world is saved
+    ChunkIO chunk_io;
+    bool persistent;
 } World;
 
 void init_blocks();
 
 void destroy_chunk(Chunk *chunk);
+// Meshes on the calling thread and replaces the drawn mesh right away, pending mesh jobs of the chunk are dropped
 void mesh_chunk(Chunk *chunk, bool update_flag);
 Block *chunk_get(Chunk *chunk, u8 x, u8 y, u8 z);
 void chunk_set(Chunk *chunk, const Block *block, u8 x, u8 y, u8 z);
 
-World *init_world();
+// cache_budget is in bytes, world_dir may be NULL to not save the world
+World *init_world(u32 load_distance, u32 view_distance, u64 cache_budget, const char *world_dir);
 Chunk *get_chunk(i32 x, i32 y);
-void update_world();
+// Generates chunks and queues mesh jobs nearest first until budget_ns is used up, at least one of each per call
+// Meshes finished since the last call replace the drawn ones, so call it between frames
+void update_world(u64 budget_ns);
 void load_chunks();
+
+// Distances are clamped to 1..MAX_LOAD_DISTANCE, the view distance to at most the load distance
+void set_load_distance(u32 load_distance);
+void set_view_distance(u32 view_distance);
+// Far plane that covers everything within the view distance
+f32 view_far_plane();
+// frustum_planes from glms_frustum_planes() of proj * view
+bool chunk_visible(const Chunk *chunk, vec4s frustum_planes[6]);
+
 void world_set(const Block *block, i32 x, i32 y, i32 z);
 void world_set_and_mesh(const Block *block, i32 x, i32 y, i32 z);
 Block *world_get(i32 x, i32 y, i32 z);
+
+void init_block_accessor(BlockAccessor *accessor);
+// Same as world_get()
+Block *accessor_get(BlockAccessor *accessor, i32 x, i32 y, i32 z);
 void destroy_world();
 
 #endif
\ No newline at end of file